@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "global.h"
+
+// Arithmetic expansion $((...)) with 64-bit integers.
+//
+// An expression is compiled once into the bytecode of a small stack machine
+// and kept in a cache keyed by its text, so an expression evaluated in a
+// loop is only parsed the first time.  Variables are referenced by name
+// from the bytecode and looked up at each evaluation.
+
+enum {
+    A_PUSH,     // push consts[arg]
+    A_LOAD,     // push the value of vars[arg]
+    A_STORE,    // vars[arg] = top, keeping it on the stack
+    A_POP,
+    A_DUP,
+    A_NEG, A_NOT, A_BNOT,
+    A_POW, A_MUL, A_DIV, A_MOD, A_ADD, A_SUB, A_SHL, A_SHR,
+    A_LT, A_LE, A_GT, A_GE, A_EQ, A_NE, A_BAND, A_BXOR, A_BOR,
+    A_JZ,       // pop, jump if zero
+    A_JMP,
+    A_ANDJ,     // if top is zero, jump keeping it; otherwise pop
+    A_ORJ,      // if top is not zero, make it 1 and jump; otherwise pop
+    A_BOOL      // top = (top != 0)
+};
+
+#define A_MAXREFS 256    // constants and variables an expression may use
+#define A_MAXDEPTH 64    // stack depth an expression may use
+
+struct expr {
+    char *text;             // the source, key of the cache
+    size_t len;
+    unsigned char *code;    // opcodes, followed by their operand if any
+    int ncode;
+    long long *consts;
+    int nconsts;
+    char **vars;            // names of the variables
+    int nvars;
+    struct expr *next;      // next expression of the cache bucket
+};
+
+// state of the compiler
+struct comp {
+    struct expr *e;
+    const char *p;          // next character of the source
+    const char *end;
+    int cap;                // capacity of e->code
+    int depth;              // stack depth at the current point of the code
+    int error;
+};
+
+// the operators, longest first so that the longest one is recognized
+static const char *operators[] = {
+    "<<=", ">>=",
+    "**", "<=", ">=", "==", "!=", "&&", "||", "<<", ">>", "++", "--",
+    "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=",
+    "<", ">", "+", "-", "*", "/", "%", "&", "^", "|", "!", "~",
+    "?", ":", "=", "(", ")", ",",
+    NULL
+};
+
+// the binary operators by precedence level, lowest first, with their opcodes
+static struct {
+    const char *op[4];
+    int code[4];
+} levels[] = {
+    { { "|" },                   { A_BOR } },
+    { { "^" },                   { A_BXOR } },
+    { { "&" },                   { A_BAND } },
+    { { "==", "!=" },            { A_EQ, A_NE } },
+    { { "<", "<=", ">", ">=" },  { A_LT, A_LE, A_GT, A_GE } },
+    { { "<<", ">>" },            { A_SHL, A_SHR } },
+    { { "+", "-" },              { A_ADD, A_SUB } },
+    { { "*", "/", "%" },         { A_MUL, A_DIV, A_MOD } },
+};
+#define NLEVELS (int) (sizeof(levels) / sizeof(levels[0]))
+
+#define A_CACHE 512     // buckets of the cache
+#define A_CACHEMAX 4096 // expressions kept before the cache is emptied
+
+static struct expr *cache[A_CACHE];
+static int cached;
+
+static void emit (struct comp *c, int op, int depth) {
+    if (c->e->ncode + 3 > c->cap) {
+        c->cap = c->cap ? 2 * c->cap : 64;
+        c->e->code = realloc(c->e->code, c->cap);
+    }
+    c->e->code[c->e->ncode++] = op;
+    c->depth += depth;
+    if (c->depth > A_MAXDEPTH) c->error = 1;
+}
+
+static void emit_arg (struct comp *c, int op, int arg, int depth) {
+    emit(c, op, depth);
+    c->e->code[c->e->ncode++] = arg;
+}
+
+// emit a jump and return the position of its 2-byte target
+static int emit_jump (struct comp *c, int op, int depth) {
+    emit(c, op, depth);
+    c->e->ncode += 2;
+    return c->e->ncode - 2;
+}
+
+// make the jump whose target is at pos land at the current position
+static void patch (struct comp *c, int pos) {
+    int to = c->e->ncode;
+
+    if (to > 0xffff) c->error = 1;
+    c->e->code[pos] = to >> 8;
+    c->e->code[pos + 1] = to & 0xff;
+}
+
+static void emit_const (struct comp *c, long long value) {
+    struct expr *e = c->e;
+    int i;
+
+    for (i = 0; i < e->nconsts && e->consts[i] != value; i++);
+    if (i == A_MAXREFS) {
+        c->error = 1;
+        return;
+    }
+    if (i == e->nconsts) {
+        e->consts = realloc(e->consts, (i + 1) * sizeof(long long));
+        e->consts[e->nconsts++] = value;
+    }
+    emit_arg(c, A_PUSH, i, 1);
+}
+
+// the operator at the current position, or NULL
+static const char *peek (struct comp *c) {
+    int i;
+
+    while (c->p < c->end && isspace((unsigned char) *c->p)) c->p++;
+    for (i = 0; operators[i]; i++) {
+        size_t n = strlen(operators[i]);
+
+        if ((size_t) (c->end - c->p) >= n && !strncmp(c->p, operators[i], n)) {
+            return operators[i];
+        }
+    }
+    return NULL;
+}
+
+// consume the operator op if it comes next
+static int accept (struct comp *c, const char *op) {
+    const char *next = peek(c);
+
+    if (!next || strcmp(next, op)) return 0;
+    c->p += strlen(op);
+    return 1;
+}
+
+// parse a variable reference (name, $name, ${name} or $?) and return its
+// index in e->vars, or -1 if there is none at the current position
+static int variable (struct comp *c) {
+    const char *p = c->p, *name;
+    size_t len;
+    int i, brace = 0, dollar = 0;
+
+    if (p < c->end && *p == '$') {
+        dollar = 1;
+        if (++p < c->end && *p == '{') {
+            brace = 1;
+            p++;
+        }
+    }
+    name = p;
+    len = dollar && p < c->end && *p == '?' ? 1 : var_namelen(p);
+    if (!len || name + len + brace > c->end) return -1;
+    p += len;
+    if (brace && *p++ != '}') return -1;
+    c->p = p;
+
+    for (i = 0; i < c->e->nvars; i++) {
+        if (strlen(c->e->vars[i]) == len && !strncmp(c->e->vars[i], name, len)) return i;
+    }
+    if (i == A_MAXREFS) {
+        c->error = 1;
+        return 0;
+    }
+    c->e->vars = realloc(c->e->vars, (i + 1) * sizeof(char*));
+    c->e->vars[c->e->nvars++] = strndup(name, len);
+    return i;
+}
+
+static void expr (struct comp *c);
+static void assignment (struct comp *c);
+
+// emit the update of variable v by ++ or --, leaving its old value on the
+// stack if post is set and its new one otherwise
+static void increment (struct comp *c, int v, int inc, int post) {
+    emit_arg(c, A_LOAD, v, 1);
+    if (post) emit(c, A_DUP, 1);
+    emit_const(c, 1);
+    emit(c, inc ? A_ADD : A_SUB, -1);
+    emit_arg(c, A_STORE, v, 0);
+    if (post) emit(c, A_POP, -1);
+}
+
+static void primary (struct comp *c) {
+    int v;
+
+    if (accept(c, "(")) {
+        expr(c);
+        if (!accept(c, ")")) c->error = 1;
+        return;
+    }
+    if (peek(c)) {
+        c->error = 1;
+        return;
+    }
+    if (c->p < c->end && isdigit((unsigned char) *c->p)) {
+        char *end;
+        long long value = strtoll(c->p, &end, 0);
+
+        c->p = end;
+        emit_const(c, value);
+        return;
+    }
+    if ((v = variable(c)) < 0) {
+        c->error = 1;
+        return;
+    }
+    if (accept(c, "++")) increment(c, v, 1, 1);
+    else if (accept(c, "--")) increment(c, v, 0, 1);
+    else emit_arg(c, A_LOAD, v, 1);
+}
+
+static void unary (struct comp *c) {
+    if (accept(c, "++") || accept(c, "--")) {
+        int inc = c->p[-1] == '+', v;
+
+        while (c->p < c->end && isspace((unsigned char) *c->p)) c->p++;
+        if ((v = variable(c)) < 0) c->error = 1;
+        else increment(c, v, inc, 0);
+    } else if (accept(c, "-")) {
+        unary(c);
+        emit(c, A_NEG, 0);
+    } else if (accept(c, "!")) {
+        unary(c);
+        emit(c, A_NOT, 0);
+    } else if (accept(c, "~")) {
+        unary(c);
+        emit(c, A_BNOT, 0);
+    } else if (accept(c, "+")) {
+        unary(c);
+    } else {
+        primary(c);
+    }
+}
+
+// exponentiation, which binds tighter than the other binary operators and
+// groups to the right
+static void power (struct comp *c) {
+    unary(c);
+    if (accept(c, "**")) {
+        power(c);
+        emit(c, A_POW, -1);
+    }
+}
+
+// binary operators of the given precedence level and above
+static void binary (struct comp *c, int level) {
+    int i, found;
+
+    if (level == NLEVELS) {
+        power(c);
+        return;
+    }
+    binary(c, level + 1);
+    do {
+        found = 0;
+        for (i = 0; i < 4 && levels[level].op[i]; i++) {
+            if (accept(c, levels[level].op[i])) {
+                binary(c, level + 1);
+                emit(c, levels[level].code[i], -1);
+                found = 1;
+                break;
+            }
+        }
+    } while (found && !c->error);
+}
+
+// logical operators, which only evaluate their right operand if needed
+static void logical (struct comp *c, const char *op, int jump) {
+    int pos;
+
+    if (jump == A_ORJ) logical(c, "&&", A_ANDJ);
+    else binary(c, 0);
+    while (!c->error && accept(c, op)) {
+        pos = emit_jump(c, jump, -1);
+        if (jump == A_ORJ) logical(c, "&&", A_ANDJ);
+        else binary(c, 0);
+        emit(c, A_BOOL, 0);
+        patch(c, pos);
+    }
+}
+
+static void conditional (struct comp *c) {
+    int pos, end;
+
+    logical(c, "||", A_ORJ);
+    if (!accept(c, "?")) return;
+    pos = emit_jump(c, A_JZ, -1);
+    expr(c);
+    end = emit_jump(c, A_JMP, -1);
+    if (!accept(c, ":")) c->error = 1;
+    patch(c, pos);
+    conditional(c);
+    patch(c, end);
+}
+
+static void assignment (struct comp *c) {
+    static const char *ops[] = { "=", "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", "&=", "^=", "|=" };
+    static const int codes[] = { 0, A_MUL, A_DIV, A_MOD, A_ADD, A_SUB, A_SHL, A_SHR, A_BAND, A_BXOR, A_BOR };
+    const char *start = c->p;
+    int v, i;
+
+    while (c->p < c->end && isspace((unsigned char) *c->p)) c->p++;
+    if ((v = variable(c)) >= 0) {
+        const char *op = peek(c);
+
+        for (i = 0; op && i < (int) (sizeof(ops) / sizeof(ops[0])); i++) {
+            if (strcmp(op, ops[i])) continue;
+            c->p += strlen(op);
+            if (codes[i]) emit_arg(c, A_LOAD, v, 1);
+            assignment(c);
+            if (codes[i]) emit(c, codes[i], -1);
+            emit_arg(c, A_STORE, v, 0);
+            return;
+        }
+    }
+    // not an assignment: parse it again as a conditional expression
+    c->p = start;
+    conditional(c);
+}
+
+static void expr (struct comp *c) {
+    assignment(c);
+    while (!c->error && accept(c, ",")) {
+        emit(c, A_POP, -1);
+        assignment(c);
+    }
+}
+
+static void expr_free (struct expr *e) {
+    int i;
+
+    for (i = 0; i < e->nvars; i++) free(e->vars[i]);
+    free(e->vars);
+    free(e->consts);
+    free(e->code);
+    free(e->text);
+    free(e);
+}
+
+static struct expr *compile (const char *text, size_t len) {
+    struct comp c;
+
+    memset(&c, 0, sizeof(struct comp));
+    c.e = calloc(1, sizeof(struct expr));
+    c.p = text;
+    c.end = text + len;
+    expr(&c);
+    peek(&c);
+    if (c.error || c.p != c.end) {
+        fprintf(stderr, "error: arithmetic: syntax error in expression: %.*s\n", (int) len, text);
+        expr_free(c.e);
+        return NULL;
+    }
+    c.e->text = strndup(text, len);
+    c.e->len = len;
+    return c.e;
+}
+
+// return the compiled expression of text, from the cache if possible
+static struct expr *lookup (const char *text, size_t len) {
+    unsigned long h = 5381;
+    struct expr *e;
+    size_t i;
+
+    for (i = 0; i < len; i++) h = h * 33 + (unsigned char) text[i];
+    h %= A_CACHE;
+    for (e = cache[h]; e; e = e->next) {
+        if (e->len == len && !memcmp(e->text, text, len)) return e;
+    }
+
+    if (!(e = compile(text, len))) return NULL;
+    if (cached == A_CACHEMAX) {
+        for (i = 0; i < A_CACHE; i++) {
+            struct expr *next;
+
+            for (; cache[i]; cache[i] = next) {
+                next = cache[i]->next;
+                expr_free(cache[i]);
+            }
+        }
+        cached = 0;
+    }
+    e->next = cache[h];
+    cache[h] = e;
+    cached++;
+    return e;
+}
+
+// the value of a variable as an integer; unset or empty variables are 0
+static long long load (const char *name) {
+    char *value = var_getn(name, strlen(name)), *end;
+    long long n;
+
+    if (!value || !*value) return 0;
+    n = strtoll(value, &end, 0);
+    while (isspace((unsigned char) *end)) end++;
+    return *end ? 0 : n;
+}
+
+static int run (struct expr *e, long long *result) {
+    long long stack[A_MAXDEPTH + 1], *sp = stack, a, b;
+    unsigned long long n;
+    unsigned char *pc = e->code, *end = e->code + e->ncode;
+    char num[32];
+
+    while (pc < end) {
+        switch (*pc++) {
+            case A_PUSH:  *++sp = e->consts[*pc++]; break;
+            case A_LOAD:  *++sp = load(e->vars[*pc++]); break;
+            case A_STORE:
+                sprintf(num, "%lld", *sp);
+                var_set(e->vars[*pc++], num, 0);
+                break;
+            case A_POP:   sp--; break;
+            case A_DUP:   sp[1] = *sp; sp++; break;
+            case A_NEG:   *sp = -(unsigned long long) *sp; break;
+            case A_NOT:   *sp = !*sp; break;
+            case A_BNOT:  *sp = ~*sp; break;
+            case A_BOOL:  *sp = *sp != 0; break;
+            case A_JZ:
+                if (!*sp--) pc = e->code + (pc[0] << 8 | pc[1]);
+                else pc += 2;
+                break;
+            case A_JMP:
+                pc = e->code + (pc[0] << 8 | pc[1]);
+                break;
+            case A_ANDJ:
+                if (!*sp) pc = e->code + (pc[0] << 8 | pc[1]);
+                else { sp--; pc += 2; }
+                break;
+            case A_ORJ:
+                if (*sp) { *sp = 1; pc = e->code + (pc[0] << 8 | pc[1]); }
+                else { sp--; pc += 2; }
+                break;
+            default:
+                // binary operators, with wrapping 64-bit arithmetic
+                b = *sp--;
+                a = *sp;
+                switch (pc[-1]) {
+                    case A_POW:
+                        if (b < 0) {
+                            fprintf(stderr, "error: arithmetic: negative exponent\n");
+                            return -1;
+                        }
+                        for (n = 1; b; b >>= 1) {
+                            if (b & 1) n *= a;
+                            a = (unsigned long long) a * a;
+                        }
+                        a = n;
+                        break;
+                    case A_MUL: a = (unsigned long long) a * b; break;
+                    case A_ADD: a = (unsigned long long) a + b; break;
+                    case A_SUB: a = (unsigned long long) a - b; break;
+                    case A_SHL: a = (unsigned long long) a << (b & 63); break;
+                    case A_SHR: a >>= b & 63; break;
+                    case A_LT:  a = a < b; break;
+                    case A_LE:  a = a <= b; break;
+                    case A_GT:  a = a > b; break;
+                    case A_GE:  a = a >= b; break;
+                    case A_EQ:  a = a == b; break;
+                    case A_NE:  a = a != b; break;
+                    case A_BAND: a &= b; break;
+                    case A_BXOR: a ^= b; break;
+                    case A_BOR: a |= b; break;
+                    case A_DIV:
+                    case A_MOD:
+                        if (!b) {
+                            fprintf(stderr, "error: arithmetic: division by zero\n");
+                            return -1;
+                        }
+                        if (b == -1) a = pc[-1] == A_DIV ? (long long) -(unsigned long long) a : 0;
+                        else a = pc[-1] == A_DIV ? a / b : a % b;
+                        break;
+                }
+                *sp = a;
+        }
+    }
+    *result = *sp;
+    return 0;
+}
+
+// evaluate the expression text[0..len)
+int arith (const char *text, size_t len, long long *result) {
+    struct expr *e;
+    size_t i;
+
+    // an empty expression is 0
+    for (i = 0; i < len && isspace((unsigned char) text[i]); i++);
+    if (i == len) {
+        *result = 0;
+        return 0;
+    }
+    if (!(e = lookup(text, len))) return -1;
+    return run(e, result);
+}
@@ -0,0 +1,469 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "global.h"
+
+// The builtin commands run in the shell's own process, with the redirections
+// of the command already applied to its stdin, stdout and stderr.  They
+// write their output with bi_write, which appends it to the buffer of a
+// command substitution directly when one captures it.  Those reading their
+// input with bi_read, touching nothing else of the shell, may also run as
+// threads of a pipeline, with the ring buffers joining them or the pipe
+// they write to in bi_io.
+
+#define SOURCE_BLOCK 65536
+
+// the buffer of the command substitution capturing the output, if any
+struct buf *capture;
+
+// the ring buffers or the pipe of the builtin run by the thread, if it is a
+// stage of a pipeline
+__thread struct stageio *bi_io;
+
+int bi_write (const char *s, size_t n) {
+    ssize_t w;
+    int fd = 1;
+
+    if (bi_io && bi_io->out) {
+        if (ring_write(bi_io->out, s, n) == -1) {
+            bi_io->broken = 1;
+            return -1;
+        }
+        return 0;
+    }
+    if (bi_io && bi_io->outfd != -1) {
+        fd = bi_io->outfd;
+    } else if (capture) {
+        buf_add(capture, s, n);
+        return 0;
+    }
+    for (; n; s += w, n -= w) {
+        if ((w = write(fd, s, n)) == -1) {
+            if (errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            // a thread is not stopped by SIGPIPE
+            if (errno == EPIPE && bi_io) {
+                bi_io->broken = 1;
+                return -1;
+            }
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// return the file descriptor bi_write writes to, -1 if the output does not
+// go to one
+int bi_outfd (void) {
+    if (bi_io && bi_io->out) return -1;
+    if (bi_io && bi_io->outfd != -1) return bi_io->outfd;
+    return capture ? -1 : 1;
+}
+
+// read at most n bytes of the input into s; returns 0 at its end, -1 on error
+long bi_read (char *s, size_t n) {
+    ssize_t r;
+
+    if (bi_io && bi_io->in) return ring_read(bi_io->in, s, n);
+    while ((r = read(0, s, n)) == -1 && errno == EINTR && !bi_interrupted);
+    return r;
+}
+
+// SIGINT, which the shell ignores, stops the builtins copying their input
+// while they run: it sets bi_interrupted, which their loops check, and
+// interrupts the call they may be blocked in.  The threads of a pipeline of
+// builtins get it in turn, so that the one waiting for its input sees it.
+volatile sig_atomic_t bi_interrupted;
+static pthread_t *catch_threads;
+static int catch_count, catching;
+static struct sigaction catch_saved;
+
+static void bi_interrupt (int sig) {
+    int i, n = __atomic_load_n(&catch_count, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&bi_interrupted, 1, __ATOMIC_SEQ_CST)) return;
+    for (i = 0; i < n; i++) {
+        if (!pthread_equal(catch_threads[i], pthread_self())) pthread_kill(catch_threads[i], SIGINT);
+    }
+}
+
+// start catching SIGINT; the calls nest
+void bi_catch (void) {
+    struct sigaction sa;
+
+    if (catching++) return;
+    bi_interrupted = 0;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = bi_interrupt;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &catch_saved);
+}
+
+// stop catching SIGINT, once the outermost call is over
+void bi_release (void) {
+    if (--catching) return;
+    sigaction(SIGINT, &catch_saved, NULL);
+    bi_interrupted = 0;
+}
+
+// pass SIGINT on to the first n of threads, which have not been joined
+void bi_catch_threads (pthread_t *threads, int n) {
+    catch_threads = threads;
+    __atomic_store_n(&catch_count, n, __ATOMIC_SEQ_CST);
+}
+
+// append the argument s to line with its backslash escapes expanded, as
+// echo -e does; returns 0 after a \c, which ends the output
+static int echo_escapes (struct buf *line, const char *s) {
+    int c, k;
+
+    for (; *s; s++) {
+        if (*s != '\\' || !s[1]) {
+            buf_addc(line, *s);
+            continue;
+        }
+        switch (*++s) {
+            case 'a': c = '\a'; break;
+            case 'b': c = '\b'; break;
+            case 'c': return 0;
+            case 'e': c = 033; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'v': c = '\v'; break;
+            case '\\': c = '\\'; break;
+            case '0':
+                // \0 and up to three octal digits
+                for (c = 0, k = 0; k < 3 && s[1] >= '0' && s[1] <= '7'; k++) c = c * 8 + *++s - '0';
+                break;
+            case 'x':
+                // \x and one or two hexadecimal digits
+                if (!isxdigit((unsigned char) s[1])) {
+                    buf_add(line, "\\x", 2);
+                    continue;
+                }
+                for (c = 0, k = 0; k < 2 && isxdigit((unsigned char) s[1]); k++) {
+                    s++;
+                    c = c * 16 + (isdigit((unsigned char) *s) ? *s - '0' : (tolower((unsigned char) *s) - 'a' + 10));
+                }
+                break;
+            default:
+                buf_addc(line, '\\');
+                c = *s;
+        }
+        buf_addc(line, c);
+    }
+    return 1;
+}
+
+// builtin "echo" (write the arguments; -n omits the newline, -e expands the
+// backslash escapes and -E, the default, does not, as /bin/echo does)
+static int builtin_echo (char **args) {
+    struct buf line;
+    int i, newline = 1, escapes = 0, retval;
+    const char *opt;
+
+    // the options: words made of n, e and E only
+    for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strspn(args[i] + 1, "neE") != strlen(args[i] + 1)) break;
+        for (opt = args[i] + 1; *opt; opt++) {
+            if (*opt == 'n') newline = 0;
+            else escapes = *opt == 'e';
+        }
+    }
+
+    memset(&line, 0, sizeof(struct buf));
+    for (; args[i]; i++) {
+        if (!escapes) {
+            buf_add(&line, args[i], strlen(args[i]));
+        } else if (!echo_escapes(&line, args[i])) {
+            newline = 0;
+            break;
+        }
+        if (args[i+1]) buf_addc(&line, ' ');
+    }
+    if (newline) buf_addc(&line, '\n');
+    retval = line.len ? bi_write(line.s, line.len) : 0;
+    free(line.s);
+    return retval;
+}
+
+// builtin "pwd" (print the working directory)
+static int builtin_pwd (char **args) {
+    char cwd[MAXPATHLEN + 1];
+    size_t len;
+
+    if (getcwd(cwd, MAXPATHLEN) == NULL) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+    len = strlen(cwd);
+    cwd[len++] = '\n';
+    return bi_write(cwd, len);
+}
+
+// builtin "cd" (change directory)
+static int builtin_cd (char **args) {
+    char cwd[MAXPATHLEN + 1];
+
+    if (chdir(args[1]) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (getcwd(cwd, MAXPATHLEN) == NULL) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (var_set("PWD", cwd, V_EXPORT)) {
+        fprintf(stderr, "error: cannot update $PWD\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// builtin "export" (pass variables to the commands' environment)
+static int builtin_export (char **args) {
+    int i, retval = 0;
+
+    if (!args[1]) {
+        // list the exported variables
+        char **env = var_environ();
+
+        for (i = 0; env[i] && retval == 0; i++) {
+            retval = bi_write("export ", 7);
+            if (!retval) retval = bi_write(env[i], strlen(env[i]));
+            if (!retval) retval = bi_write("\n", 1);
+        }
+        return retval;
+    }
+
+    for (i = 1; args[i]; i++) {
+        size_t len = var_namelen(args[i]);
+
+        if (!len || (args[i][len] && args[i][len] != '=')) {
+            fprintf(stderr, "error: export: %s: not a valid identifier\n", args[i]);
+            retval = -1;
+            continue;
+        }
+        var_setn(args[i], len, args[i][len] ? args[i] + len + 1 : NULL, V_EXPORT);
+    }
+    return retval;
+}
+
+// builtin "unset" (remove variables)
+static int builtin_unset (char **args) {
+    int i;
+
+    for (i = 1; args[i]; i++) var_unset(args[i]);
+    return 0;
+}
+
+// shell options, turned on with "set -o name" and off with "set +o name"
+int opt_batch;      // run argument lists too long for execve in batches
+int opt_pipegrow;   // grow the buffers of the pipes found full
+int opt_pipestats;  // time the stages of the pipelines
+int opt_parallel;   // run the commands of a sequence writing files at once
+
+static struct {
+    char *name;
+    int *flag;
+} options[] = {
+    { "batch", &opt_batch },
+    { "pipegrow", &opt_pipegrow },
+    { "parallel", &opt_parallel },
+    { "pipestats", &opt_pipestats },
+    { NULL, NULL }
+};
+
+// builtin "set" (-o name and +o name to turn an option on and off; the
+// options are listed without arguments)
+static int builtin_set (char **args) {
+    int i, j, retval = 0;
+    char line[64];
+
+    if (!args[1]) {
+        for (j = 0; options[j].name && !retval; j++) {
+            sprintf(line, "set %co %s\n", *options[j].flag ? '-' : '+', options[j].name);
+            retval = bi_write(line, strlen(line));
+        }
+        return retval;
+    }
+    for (i = 1; args[i]; i += 2) {
+        if ((strcmp(args[i], "-o") && strcmp(args[i], "+o")) || !args[i+1]) {
+            fprintf(stderr, "error: set: usage: set -o|+o option\n");
+            return -1;
+        }
+        for (j = 0; options[j].name && strcmp(options[j].name, args[i+1]); j++);
+        if (!options[j].name) {
+            fprintf(stderr, "error: set: %s: no such option\n", args[i+1]);
+            return -1;
+        }
+        *options[j].flag = args[i][0] == '-';
+    }
+    return 0;
+}
+
+// open the file the name given to source stands for: a name without a
+// slash is looked for in $PATH, then in the current directory
+static int source_open (char *name) {
+    char *path = var_get("PATH"), *end, *full;
+    int fd;
+
+    if (!strchr(name, '/') && path) {
+        for (; ; path = end + 1) {
+            size_t n;
+
+            end = strchrnul(path, ':');
+            n = end - path;
+            full = malloc(n + strlen(name) + 2);
+            sprintf(full, "%.*s%s%s", (int) n, path, n ? "/" : "", name);
+            fd = open(full, O_RDONLY | O_CLOEXEC);
+            free(full);
+            if (fd != -1) return fd;
+            if (!*end) break;
+        }
+    }
+    return open(name, O_RDONLY | O_CLOEXEC);
+}
+
+// builtin "source" or "." (run the commands of a file in the shell itself,
+// each as soon as it has been read and parsed).  The file is read with its
+// own buffer rather than stdio, whose buffers the children would flush.
+static int builtin_source (char **args) {
+    struct buf text;
+    char *line, *nl;
+    size_t len = 0, cap = SOURCE_BLOCK, used = 0;
+    ssize_t n;
+    int retval = 0, fd, eof = 0, owned = stdin_owned;
+
+    if (!args[1]) {
+        fprintf(stderr, "error: %s: filename argument required\n", args[0]);
+        return -1;
+    }
+    if ((fd = source_open(args[1])) == -1) {
+        fprintf(stderr, "error: %s: %s: %s\n", args[0], args[1], strerror(errno));
+        return -1;
+    }
+    memset(&text, 0, sizeof(struct buf));
+    line = malloc(cap);
+    // the commands of the file share its input, even when the file is run
+    // by a plain command reading a pipe of its own
+    stdin_owned = 0;
+    for (;;) {
+        struct cmd *cmd;
+
+        // the next line, without its newline
+        while (!eof && !(nl = memchr(line + used, '\n', len - used))) {
+            memmove(line, line + used, len -= used);
+            used = 0;
+            if (cap - len < SOURCE_BLOCK) line = realloc(line, cap *= 2);
+            if ((n = read(fd, line + len, SOURCE_BLOCK)) == -1 && errno == EINTR) continue;
+            if (n <= 0) eof = 1;
+            else len += n;
+        }
+        if (eof && used == len) break;
+        if (eof) nl = line + len;
+
+        // lines are added until they make a complete command, the scanner
+        // taking a backslash at the end of a line to continue it
+        if (text.len) buf_addc(&text, '\n');
+        buf_add(&text, line + used, nl - (line + used));
+        used = nl - line + (nl < line + len);
+        if (!(cmd = parser(text.s, 1)) && parse_incomplete) continue;
+        text.len = 0;
+        if (cmd) retval = execute(cmd);
+    }
+    if (text.len) {
+        // the end of the file came in the middle of a command, which may
+        // still be whole, such as one ending in a backslash
+        struct cmd *cmd = parser(text.s, 0);
+
+        retval = cmd ? execute(cmd) : -1;
+    }
+    stdin_owned = owned;
+    free(line);
+    free(text.s);
+    close(fd);
+    return retval;
+}
+
+#define B_STAGE 1       // it may run as a thread of a pipeline
+#define B_SIGINT 2      // it copies its input until SIGINT stops it
+
+static struct {
+    char *name;
+    builtin_fn *func;
+    int flags;
+    builtin_fn *takes;  // whether it takes the arguments, if not all
+} builtins[] = {
+    { ".", builtin_source, 0, NULL },
+    { "cat", builtin_cat, B_STAGE | B_SIGINT, cat_takes },
+    { "cd", builtin_cd, 0, NULL },
+    { "echo", builtin_echo, B_STAGE, NULL },
+    { "exec", builtin_exec, 0, NULL },
+    { "export", builtin_export, 0, NULL },
+    { "mapfile", builtin_mapfile, 0, NULL },
+    { "pipestats", builtin_pipestats, 0, NULL },
+    { "pwd", builtin_pwd, B_STAGE, NULL },
+    { "read", builtin_read, 0, NULL },
+    { "readarray", builtin_mapfile, 0, NULL },
+    { "replicate", builtin_replicate, B_SIGINT, NULL },
+    { "set", builtin_set, 0, NULL },
+    { "source", builtin_source, 0, NULL },
+    { "tee", builtin_tee, B_SIGINT, tee_takes },
+    { "unset", builtin_unset, 0, NULL },
+    { NULL, NULL, 0, NULL }
+};
+
+// return the builtin command of args, or NULL if there is none or it does
+// not take the arguments, the program of the same name running instead
+builtin_fn *builtin_lookup (char **args) {
+    int i;
+
+    for (i = 0; builtins[i].name; i++) {
+        if (strcmp(builtins[i].name, args[0]) == 0) {
+            return !builtins[i].takes || builtins[i].takes(args) ? builtins[i].func : NULL;
+        }
+    }
+    return NULL;
+}
+
+// return the builtin command of args if it may run as a thread of a
+// pipeline, else NULL
+builtin_fn *builtin_stage (char **args) {
+    int i;
+
+    for (i = 0; builtins[i].name; i++) {
+        if (strcmp(builtins[i].name, args[0]) == 0) {
+            return (builtins[i].flags & B_STAGE) && builtin_lookup(args) ? builtins[i].func : NULL;
+        }
+    }
+    return NULL;
+}
+
+// whether SIGINT is to stop the builtin command func, which the shell runs
+// catching it
+int builtin_sigint (builtin_fn *func) {
+    int i;
+
+    for (i = 0; builtins[i].name; i++) {
+        if (builtins[i].func == func) return builtins[i].flags & B_SIGINT;
+    }
+    return 0;
+}
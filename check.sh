@@ -0,0 +1,236 @@
+#!/bin/sh
+# Tests of the shell (make check).  The command lines given to "same" must
+# behave as under /bin/sh: the same output and the same status.  The ones
+# given to "expect", using what /bin/sh lacks, must print the output given
+# and succeed.  Each runs with its standard input the file "lines", in a
+# directory of its own.
+#
+# usage: sh check.sh [shell]
+
+shell=${1:-./shell}
+case $shell in /*) ;; *) shell=$(pwd)/$shell ;; esac
+[ -x "$shell" ] || { echo "check.sh: no shell $shell" >&2; exit 2; }
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 2
+pass=0 fail=0
+
+mkdir -p d/a/b d/c
+touch d/x.c d/a/y.c d/a/b/z.c d/c/w.h
+printf 'one two\nthree\n' > lines
+printf 'SRCVAR=sourced\necho in src\n' > src
+printf 'read a\nread b\necho "$b|$a"\n' > readtwo
+printf 'echo a\\\\\necho b\necho c\\\nd "e\\\nf" \\\n  | cat\n' > cont
+
+# run the line $2 with shell $1, printing its output and status
+run () {
+    timeout 20 "$1" -c "$2" < lines 2>/dev/null
+    echo "status $?"
+}
+
+# report the line $1, which printed $2 instead of $3 if they differ
+report () {
+    if [ "$2" = "$3" ]; then
+        pass=$((pass + 1))
+    else
+        fail=$((fail + 1))
+        printf 'FAIL: %s\n--- wanted:\n%s\n--- got:\n%s\n\n' "$1" "$3" "$2"
+    fi
+}
+
+same () {
+    report "$1" "$(run "$shell" "$1")" "$(run /bin/sh "$1")"
+}
+
+expect () {
+    report "$1" "$(run "$shell" "$1")" "$2
+status 0"
+}
+
+# lists and pipelines
+same 'echo a; echo b && echo c || echo d'
+same 'false || echo no; true && echo yes; false && echo never'
+same 'echo a | tr a b | tr b c'
+same 'printf "x\ny\n" | cat | cat | sort -r'
+same 'echo "a  b"   '\''c  d'\'' e\ f'
+same 'echo a > f; echo b >> f; cat f; cat < f; rm f'
+same '(cd /; pwd); pwd | grep -c "^/"'
+
+# variables and $?
+same 'x=hello; echo $x ${x} "$x" ${x}s "${x}"'
+same 'x=1; x=2; echo $x; y=$x; echo "[$y] [$nope]"'
+same 'echo '\''$x'\'' "\$x" \$x'
+same 'false; echo $?; true; echo $?'
+same 'A=1 sh -c '\''echo $A'\''; echo "[$A]"'
+same 'B=local; sh -c '\''echo "[$B]"'\''; echo $B'
+same 'export E=out; sh -c '\''echo $E'\''; unset E; sh -c '\''echo "[$E]"'\'''
+
+# the environment of commands
+same 'A=1 env | grep "^A="'
+same 'export E=1; (E=2 env | grep "^E="); echo $E'
+same 'export E=1; E=2 sh -c '\''echo $E'\''; echo $E; export F=x; sh -c '\''echo $F'\'''
+same 'A=1 A=2 sh -c '\''echo $A'\''; A=1 A=2 env | grep "^A="'
+
+# parameter expansion
+same 'x=foo.tar.gz; echo ${x%.*} ${x%%.*} ${x#*.} ${x##*.}'
+same 'unset y; echo ${y:-def} ${y-def2} ${y:=now} $y'
+same 'x=abc; echo ${#x} ${x:+set} ${nope:+set}.'
+same 'x=/usr/local/bin; echo ${x%/*} ${x##*/} ${x#/usr}'
+same 'x="*"; echo "$x"; x=; echo "[${x:-empty}]"'
+expect 'x=abcdef; echo ${x:2:3} ${x/cd/CD} ${x//[ace]/.} ${x/#ab/AB} ${x/%ef/EF}' 'cde abCDef .b.d.f ABcdef abcdEF'
+
+# arithmetic
+same 'echo $((1 + 2 * 3)) $((7 / 2)) $((7 % 3)) $(( (1 + 2) * 3 ))'
+same 'i=5; i=$((i + 1)); echo $i $((i << 2)) $((i > 3)) $((i == 6 ? 10 : 20))'
+same 'echo $((-3 + 5)) $((0x10)) $((1 && 0)) $((1 || 0)) $((~0))'
+same 'a=3 b=4; echo $((a * a + b * b)) $(( $a - $b ))'
+expect 'i=1; echo $((2 ** 10)) $((i++)) $i $((++i)) $((i += 5)) $i' '1024 1 2 3 8 8'
+
+# command substitution
+same 'echo $(echo inner) "$(echo a; echo b)"'
+same 'x=$(printf "a\n\n\n"); echo "[$x]"'
+same 'x=$(echo $(echo nested)); echo $x'
+same 'x=$(pwd); [ "$x" = "$(/bin/pwd)" ] && echo pwd'
+
+# echo
+same 'echo -n a; echo b'
+expect 'echo -e '\''a\tb\x41\0101'\'' -n; echo -ne '\''x\n'\''; echo -E '\''a\tb'\''' 'a	bAA -n
+x
+a\tb'
+expect 'echo -en '\''c\c'\''; echo d; echo -ne -x; echo' 'cd
+-x'
+
+# here-documents and here-strings
+same 'cat <<E
+here $((1+1)) $HOME
+E'
+same 'cat <<'\''E'\''
+raw $x
+E'
+same 'x=1; cat <<E | tr a-z A-Z
+upper $x
+E'
+expect 'cat <<< "here string"; tr a-z A-Z <<< word' 'here string
+WORD'
+
+# process substitution
+expect 'cat <(echo ps) <(echo two)' 'ps
+two'
+expect 'diff <(echo a) <(echo a) && echo same' 'same'
+expect 'echo hi > >(tr a-z A-Z)' 'HI'
+
+# case
+same 'case foo.c in *.h) echo h;; *.c) echo c;; *) echo other;; esac'
+same 'case b in a|b) echo ab;; esac; case x in [a-z]) echo lower;; esac'
+same 'case "a b" in "a b") echo quoted;; esac; case "*" in "*") echo star;; esac'
+same 'x=a; case abc in $x*) echo var;; esac; case z in a) echo no;; esac'
+same 'case c.h in a|"b"|c*) echo mixed;; esac; case x in "$nope"x) echo expanded;; esac'
+
+# [[ ]] and =~
+expect '[[ abc == a* ]] && echo glob; [[ abc == "a*" ]] || echo literal' 'glob
+literal'
+expect '[[ foo123 =~ ^[a-z]+([0-9]+)$ ]] && echo match ${BASH_REMATCH[1]}' 'match 123'
+expect '[[ abc =~ ^b ]] || echo nomatch' 'nomatch'
+expect '[[ 3 -lt 10 ]] && echo lt; [[ b > a ]] && echo gt' 'lt
+gt'
+
+# globs
+same 'echo d/*.c; echo d/*/; echo d/nomatch*'
+same 'echo d/[ax]*; echo "d/*"'
+expect 'echo d/**/*.c; echo d/**/*.h' 'd/a/b/z.c d/a/y.c d/x.c
+d/c/w.h'
+expect 'echo d/**' 'd/a d/a/b d/a/b/z.c d/a/y.c d/c d/c/w.h d/x.c'
+
+# long argument lists, refused or run in batches
+expect '/bin/echo $(seq 400000) || echo refused' 'refused'
+expect 'set -o batch; /bin/echo $(seq 400000) | wc -w' '400000'
+# the outputs of batches run at the same time mix, but lose nothing
+expect 'set -o batch; BATCH_JOBS=4; /bin/echo $(seq 400000) | wc -c' "$(seq 400000 | wc -c)"
+
+# brace expansion
+expect 'echo {a,b,c}x pre{1..3} {a,b}{1,2}' 'ax bx cx pre1 pre2 pre3 a1 a2 b1 b2'
+expect 'echo {3..1} {a..c} x{,y} {1..10..3}' '3 2 1 a b c x xy 1 4 7 10'
+expect 'echo "{a,b}" \{a,b\} {a}' '{a,b} {a,b} {a}'
+expect 'set -o batch; /bin/echo {1..400000} | wc -w' '400000'
+
+# read and mapfile
+same 'read a b < lines; echo "$a|$b"'
+same 'read -r a < lines; echo $a'
+same 'IFS=:; echo a:b | (read x y; echo $y $x)'
+same 'cat lines | (read a; read b; echo "$b|$a")'
+expect 'read -a W < lines; echo ${W[1]}' 'two'
+expect 'mapfile -t L < lines; echo ${#L[@]} "${L[0]}" "${L[1]}"' '2 one two three'
+expect 'mapfile -t -s 1 L < lines; echo "${L[0]}"' 'three'
+
+# source and exec
+same '. ./src; echo $SRCVAR'
+same '(printf "x\ny\n" | cat | . ./readtwo); cat lines | . ./readtwo'
+# a backslash at the end of a line continues it, unless it is escaped
+same '. ./cont'
+same 'exec echo replaced; echo not reached'
+same 'nosuchcommand 2>/dev/null; echo after'
+# a failed exec leaves the shell as it was
+expect 'A=1 exec /nonexistent; sh -c '\''echo "[$A]"'\''' '[]'
+
+# the shell's standard input, shared by the commands reading it
+same 'read a; read b; echo "$b|$a"'
+same 'cat; cat lines - < lines'
+expect 'mapfile -t -n 1 L; read x; echo "${L[0]}|$x"' 'one two|three'
+
+# concurrent pipelines: &| and &; run the producers side by side, tee copies
+# a stream, replicate runs a stage as several copies
+expect 'echo a &| echo b | sort' 'a
+b'
+expect 'echo a &; echo b' 'a
+b'
+expect '(printf "x\n" | tee t1 t2 | cat); cat t1 t2' 'x
+x
+x'
+expect '(seq 100000 | tee t1 | wc -l); wc -l < t1' '100000
+100000'
+# the options of tee the builtin lacks run /usr/bin/tee
+same '(echo x | tee -p t3 > /dev/null); cat t3'
+same 'echo x > t4; (echo y | tee t4 -a -- -a); cat t4 ./-a; rm ./-a'
+expect 'seq 1000 | replicate -n 2 -s 100 cat | sum' "$(seq 1000 | sum)"
+expect 'printf "1\n2\n3\n4\n" | replicate -n 2 -s 1 tr 1-4 a-d' 'a
+b
+c
+d'
+
+# pipe buffers, and the statistics of the stages, which go to stderr
+expect 'PIPE_SIZE=1048576; seq 100000 | tr 0 o | wc -l' '100000'
+expect 'set -o pipegrow; seq 100000 | tr 0 o | cat | wc -l' '100000'
+expect 'set -o pipestats; seq 100000 | tr 0 o | cat | wc -l' '100000'
+
+# pipelines of builtins, run as threads, and a leading cat fed by the shell
+expect 'seq 100000 | cat | tr 0 o | cat | wc -l' '100000'
+same '(echo a | cat | cat); printf "b\n" | cat | cat | cat'
+expect '(echo b | cat | tee t9 | cat); cat t9' 'b
+b'
+same '(cat lines | cat | wc -l); cat lines lines | tr a-z A-Z'
+same 'seq 100000 > n; (cat n | wc -l); cat < n | tail -n 1'
+
+# compressed redirections
+expect 'echo abc >z zz; cat <z zz; echo more >>z zz; cat <z zz' 'abc
+abc
+more'
+expect 'seq 3 >z zz; gzip -dc zz' '1
+2
+3'
+same 'echo z>plain; cat plain; echo hi >z; cat z; echo a >zq; cat zq'
+
+# parallel sequences
+expect 'set -o parallel; PARALLEL_JOBS=2; echo p1 > p1; echo p2 > p2; cat p1 p2' 'p1
+p2'
+expect 'set -o parallel; PARALLEL_JOBS=4; echo 1 > s; cat s > s2; echo 2 >> s2; cat s2' '1
+2'
+# the commands reading the shell's input read it in order
+expect 'set -o parallel; PARALLEL_JOBS=4; sh -c "sleep 0.1; head -n 1" > h1; head -n 1 > h2; cat h1 h2' 'one two
+three'
+
+# the options of cat the builtin lacks run /bin/cat
+same 'cat -n lines; cat -u lines; cat -- lines'
+same 'cat -A lines | cat -n'
+
+echo "$pass passed, $fail failed"
+[ "$fail" = 0 ]
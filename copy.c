@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "global.h"
+
+// The builtins copying their input: tee and cat.  tee duplicates a pipe in
+// the kernel: tee(2) gives each output pipe a reference to the pages of the
+// input without consuming them, the outputs that are not pipes get theirs
+// through a pipe of their own, from which splice(2) moves them on, and the
+// input is only consumed once every output has its copy.  An output pipe too
+// full to take all of a round gets the rest through its own pipe in the same
+// way.  The data only goes through a buffer when the input is not a pipe or
+// the output is captured by a command substitution.  cat likewise moves a
+// file with sendfile(2) and a pipe with splice(2).
+
+#define COPY_BLOCK 65536
+#define COPY_CHUNK (1 << 30)    // most moved by one sendfile or splice
+
+struct output {
+    int fd;
+    int via[2];         // the pipe the data goes through, if needed
+    int ispipe;
+    int failed;
+};
+
+static void output_error (struct output *o, const char *name) {
+    fprintf(stderr, "error: %s: %s\n", name, strerror(errno));
+    o->failed = 1;
+}
+
+// write all of s[0..n) to fd
+static int write_all (int fd, const char *s, size_t n) {
+    ssize_t w;
+
+    for (; n; s += w, n -= w) {
+        if ((w = write(fd, s, n)) == -1) {
+            if (errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// move n bytes from the pipe from to fd, through buf if fd does not
+// support splice
+static int drain (int from, int fd, size_t n, char *buf) {
+    ssize_t m;
+
+    while (n && !bi_interrupted) {
+        m = splice(from, NULL, fd, NULL, n, SPLICE_F_MOVE);
+        if (m == -1 && errno == EINVAL) {
+            if ((m = read(from, buf, n < COPY_BLOCK ? n : COPY_BLOCK)) > 0 && write_all(fd, buf, m) == -1) return -1;
+        }
+        if (m == -1 && errno == EINTR) continue;
+        if (m <= 0) return -1;
+        n -= m;
+    }
+    return n ? -1 : 0;
+}
+
+// give the output its own pipe, as large as the input one so that it can
+// take a whole round
+static int output_via (struct output *o) {
+    int size = fcntl(0, F_GETPIPE_SZ);
+
+    if (o->via[0] != -1) return 0;
+    if (pipe2(o->via, O_CLOEXEC) == -1) return -1;
+    if (size > 0) fcntl(o->via[1], F_SETPIPE_SZ, size);
+    return 0;
+}
+
+// copy the input pipe to the outputs without taking its data into user
+// space; returns 1 if it cannot be done that way
+static int tee_pipe (struct output *out, int n, char **names, char *buf) {
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC), i, live;
+    ssize_t len, m, sent;
+
+    if (null == -1) return 1;
+    while (!bi_interrupted) {
+        len = -1;
+        for (i = 0, live = 0; i < n; i++) {
+            struct output *o = &out[i];
+
+            if (o->failed) continue;
+            live++;
+            sent = 0;
+            if (o->ispipe) {
+                // the first output sets the size of the round
+                while ((sent = tee(0, o->fd, len == -1 ? INT_MAX : len, 0)) == -1 && errno == EINTR && !bi_interrupted);
+                if (bi_interrupted) goto done;
+                if (sent == -1) {
+                    output_error(o, names[i]);
+                    continue;
+                }
+                if (len == -1) {
+                    if (!(len = sent)) goto done;
+                    continue;
+                }
+                if (sent == len) continue;
+            }
+
+            // the rest of the round goes through the output's own pipe, the
+            // bytes already written being dropped from it
+            if (output_via(o) == -1) {
+                output_error(o, names[i]);
+                continue;
+            }
+            while ((m = tee(0, o->via[1], len == -1 ? INT_MAX : len, 0)) == -1 && errno == EINTR && !bi_interrupted);
+            if (bi_interrupted || (len == -1 && (len = m) <= 0)) goto done;
+            if (m != len) {
+                output_error(o, names[i]);
+                continue;
+            }
+            if (drain(o->via[0], null, sent, buf) == -1 || drain(o->via[0], o->fd, len - sent, buf) == -1) {
+                if (bi_interrupted) goto done;
+                output_error(o, names[i]);
+            }
+        }
+        if (!live) break;
+
+        // every output has its copy: the round is consumed
+        if (drain(0, null, len, buf) == -1) break;
+    }
+done:
+    close(null);
+    return 0;
+}
+
+// whether the tee builtin takes the arguments, which may not be expanded
+// yet: the options are -a and -i, anywhere before --, as with /usr/bin/tee,
+// and a word that may expand to an option is not taken.  The /usr/bin/tee
+// of the other options runs instead.
+int tee_takes (char **args) {
+    int i;
+
+    for (i = 1; args[i] && strcmp(args[i], "--"); i++) {
+        if (args[i][0] == '-' && args[i][1] && strcmp(args[i], "-a") && strcmp(args[i], "-i")) return 0;
+        if (strchr("$`'\"\\{*?[", args[i][0])) return 0;
+    }
+    return 1;
+}
+
+// builtin "tee" (copy the input to the output and to the files given, -a
+// appending to them; -i is accepted and ignored)
+int builtin_tee (char **args) {
+    struct output *out;
+    struct stat st;
+    char *buf, **names;
+    int i, n = 0, opts = 1, flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, retval = 0;
+    ssize_t len;
+
+    // the options may come after the files, as tee_takes has it
+    for (i = 1; args[i] && strcmp(args[i], "--"); i++) {
+        if (!strcmp(args[i], "-a")) {
+            flags = (flags & ~O_TRUNC) | O_APPEND;
+        } else if (args[i][0] == '-' && args[i][1] && strcmp(args[i], "-i")) {
+            fprintf(stderr, "error: tee: usage: tee [-a] [-i] [file ...]\n");
+            return -1;
+        }
+    }
+
+    // the output is the first of the outputs
+    out = calloc(1, sizeof(struct output));
+    names = malloc(sizeof(char*));
+    out[n].fd = capture ? -1 : 1;
+    names[n++] = "stdout";
+    for (i = 1; args[i]; i++) {
+        int fd;
+
+        if (opts && !strcmp(args[i], "--")) {
+            opts = 0;
+            continue;
+        }
+        if (opts && (!strcmp(args[i], "-a") || !strcmp(args[i], "-i"))) continue;
+        if ((fd = open(args[i], flags, 0666)) == -1) {
+            fprintf(stderr, "error: tee: %s: %s\n", args[i], strerror(errno));
+            retval = -1;
+            continue;
+        }
+        out = realloc(out, (n + 1) * sizeof(struct output));
+        names = realloc(names, (n + 1) * sizeof(char*));
+        memset(&out[n], 0, sizeof(struct output));
+        out[n].fd = fd;
+        names[n++] = args[i];
+    }
+    for (i = 0; i < n; i++) {
+        out[i].via[0] = out[i].via[1] = -1;
+        out[i].ispipe = out[i].fd != -1 && fstat(out[i].fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    }
+
+    buf = malloc(COPY_BLOCK);
+    if (capture || fstat(0, &st) == -1 || !S_ISFIFO(st.st_mode) || tee_pipe(out, n, names, buf)) {
+        // through the buffer
+        while (!bi_interrupted && (len = read(0, buf, COPY_BLOCK)) != 0) {
+            if (len == -1) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "error: tee: %s\n", strerror(errno));
+                retval = -1;
+                break;
+            }
+            for (i = 0; i < n; i++) {
+                if (out[i].failed) continue;
+                if (out[i].fd == -1) bi_write(buf, len);
+                else if (write_all(out[i].fd, buf, len) == -1) output_error(&out[i], names[i]);
+            }
+        }
+    }
+
+    if (bi_interrupted) retval = -1;
+    for (i = 0; i < n; i++) {
+        if (out[i].failed) retval = -1;
+        if (out[i].via[0] != -1) {
+            close(out[i].via[0]);
+            close(out[i].via[1]);
+        }
+        if (i) close(out[i].fd);
+    }
+    free(buf);
+    free(names);
+    free(out);
+    return retval;
+}
+
+// copy the file or pipe fd to the file descriptor out in the kernel, with
+// sendfile(2) or splice(2); returns 1 if it cannot be done that way
+static int cat_kernel (int fd, int out, const char *name) {
+    struct stat st;
+    ssize_t len;
+    int first = 1;
+
+    if (fstat(fd, &st) == -1 || (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode))) return 1;
+    for (;; first = 0) {
+        if (bi_interrupted) return -1;
+        if (S_ISREG(st.st_mode)) len = sendfile(out, fd, NULL, COPY_CHUNK);
+        else len = splice(fd, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+        if (len > 0) continue;
+        if (len == 0) return 0;
+        if (errno == EINTR) continue;
+        if (first && (errno == EINVAL || errno == ENOSYS)) return 1;
+        if (errno == EPIPE && bi_io) {
+            bi_io->broken = 1;
+            return -1;
+        }
+        fprintf(stderr, "error: cat: %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+}
+
+// copy the file fd, or the input if fd is -1, to the output
+static int cat_fd (int fd, const char *name, char *buf) {
+    ssize_t len;
+    int out = bi_outfd(), r;
+
+    // nothing goes through the buffer unless the output is captured or the
+    // input or output is a ring
+    if (out != -1 && !(fd == -1 && bi_io && bi_io->in) && (r = cat_kernel(fd == -1 ? 0 : fd, out, name)) != 1) {
+        return r;
+    }
+    while (!bi_interrupted && (len = fd == -1 ? bi_read(buf, COPY_BLOCK) : read(fd, buf, COPY_BLOCK)) != 0) {
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "error: cat: %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+        if (bi_write(buf, len) == -1) return -1;
+    }
+    return bi_interrupted ? -1 : 0;
+}
+
+// whether the cat builtin takes the arguments, which may not be expanded
+// yet: the options are -u alone, anywhere before --, as with /bin/cat, and
+// a word that may expand to an option is not taken.  The /bin/cat of the
+// other options runs instead.
+int cat_takes (char **args) {
+    int i;
+
+    for (i = 1; args[i] && strcmp(args[i], "--"); i++) {
+        if (args[i][0] == '-' && args[i][1] && strcmp(args[i], "-u")) return 0;
+        if (strchr("$`'\"\\{*?[", args[i][0])) return 0;
+    }
+    return 1;
+}
+
+// builtin "cat" (copy the files given to the output, the input for - or
+// when there are none; -u is accepted and ignored)
+int builtin_cat (char **args) {
+    char *buf;
+    int i, fd, files = 0, opts = 1, retval = 0;
+
+    buf = malloc(COPY_BLOCK);
+    for (i = 1; args[i]; i++) {
+        // the options may come after the files, as cat_takes has it
+        if (opts && !strcmp(args[i], "--")) {
+            opts = 0;
+            continue;
+        }
+        if (opts && !strcmp(args[i], "-u")) continue;
+        files++;
+        if (!strcmp(args[i], "-")) {
+            fd = -1;
+        } else if ((fd = open(args[i], O_RDONLY | O_CLOEXEC)) == -1) {
+            fprintf(stderr, "error: cat: %s: %s\n", args[i], strerror(errno));
+            retval = -1;
+            continue;
+        }
+        if (cat_fd(fd, fd == -1 ? "stdin" : args[i], buf) == -1) retval = -1;
+        if (fd != -1) close(fd);
+        // the output has no reader left, or SIGINT came
+        if ((bi_io && bi_io->broken) || bi_interrupted) break;
+    }
+    if (!files) retval = cat_fd(-1, "stdin", buf);
+    free(buf);
+    return retval;
+}
@@ -0,0 +1,828 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "global.h"
+
+// Expansion of the raw words produced by the scanner: quote removal,
+// parameter expansion (with the ${name#pattern}-style operators, evaluated
+// on the value in place), arithmetic expansion, command and process
+// substitution, field splitting of the unquoted expansions, and brace and
+// pathname expansion of the argument vectors (see glob.c).
+
+// append n bytes to a growable buffer, doubling its capacity as needed
+void buf_add (struct buf *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        b->cap = b->cap ? b->cap : 64;
+        while (b->len + n + 1 > b->cap) b->cap *= 2;
+        b->s = realloc(b->s, b->cap);
+    }
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+    b->s[b->len] = 0;
+}
+
+void buf_addc (struct buf *b, char c) {
+    buf_add(b, &c, 1);
+}
+
+// append everything that can be read from fd; reads go straight into the
+// free space of the buffer, which doubles when less than 64 KiB are left
+int buf_read (struct buf *b, int fd) {
+    ssize_t n;
+
+    for (;;) {
+        if (b->cap - b->len < 65536 + 1) {
+            b->cap = b->cap ? 2 * b->cap : 65536 * 2;
+            b->s = realloc(b->s, b->cap);
+        }
+        n = read(fd, b->s + b->len, b->cap - b->len - 1);
+        if (n == 0) break;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        b->len += n;
+    }
+    if (b->s) b->s[b->len] = 0;
+    return 0;
+}
+
+// the fields a list of words expands to
+struct fields {
+    char **v;           // the finished fields, NULL-terminated
+    int n;
+    int cap;
+    struct buf cur;     // the field being built
+    int open;           // whether cur is a field even if empty ("" was seen)
+    int split;          // whether unquoted expansions are split into fields
+    int pattern;        // whether quoted glob (1) or regex (2) characters
+                        // must be escaped
+    int glob;           // whether the fields undergo pathname expansion
+    struct buf pat;     // then, the field being built as a glob pattern
+    int globbed;        // whether it has unquoted glob characters
+};
+
+static int expand (struct fields *f, char *p, char *end);
+static char *expand_word_n (char *p, char *end);
+
+static void field_push (struct fields *f, char *s) {
+    if (f->n + 1 >= f->cap) {
+        f->cap = f->cap ? 2 * f->cap : 8;
+        f->v = realloc(f->v, f->cap * sizeof(char*));
+    }
+    f->v[f->n++] = s;
+    f->v[f->n] = NULL;
+}
+
+static void field_end (struct fields *f) {
+    char **names;
+    int i;
+
+    if (!f->cur.len && !f->open) return;
+    // a field with glob characters is replaced by the names matching it,
+    // if there are any
+    if (f->globbed && (names = glob_expand(f->pat.s))) {
+        for (i = 0; names[i]; i++) field_push(f, names[i]);
+        free(names);
+        free(f->cur.s);
+    } else {
+        field_push(f, f->cur.s ? f->cur.s : strdup(""));
+    }
+    free(f->pat.s);
+    memset(&f->cur, 0, sizeof(struct buf));
+    memset(&f->pat, 0, sizeof(struct buf));
+    f->open = 0;
+    f->globbed = 0;
+}
+
+// append s[0..n) to b with a backslash before the characters of special
+static void buf_escape (struct buf *b, const char *s, size_t n, const char *special) {
+    size_t i, start;
+
+    for (i = start = 0; i < n; i++) {
+        if (!strchr(special, s[i])) continue;
+        buf_add(b, s + start, i - start);
+        buf_addc(b, '\\');
+        start = i;
+    }
+    buf_add(b, s + start, n - start);
+}
+
+// add unquoted text to the current field
+static void field_raw (struct fields *f, const char *s, size_t n) {
+    size_t i;
+
+    buf_add(&f->cur, s, n);
+    if (!f->glob) return;
+    buf_add(&f->pat, s, n);
+    for (i = 0; i < n && !f->globbed; i++) {
+        if (strchr("*?[", s[i])) f->globbed = 1;
+    }
+}
+
+// add text to the current field; in a pattern, quoted text stays literal
+static void field_lit (struct fields *f, const char *s, size_t n, int quoted) {
+    if (!quoted) {
+        field_raw(f, s, n);
+        return;
+    }
+    if (f->pattern) {
+        buf_escape(&f->cur, s, n, f->pattern == 2 ? "\\^$.|?*+()[]{}" : "*?[\\");
+        return;
+    }
+    buf_add(&f->cur, s, n);
+    if (f->glob) buf_escape(&f->pat, s, n, "*?[\\");
+}
+
+// add the result of an expansion, splitting it on $IFS unless quoted
+static void field_add (struct fields *f, const char *s, size_t n, int quoted) {
+    const char *ifs;
+    size_t i, start;
+
+    if (quoted || !f->split) {
+        field_lit(f, s, n, quoted);
+        return;
+    }
+    if (!(ifs = var_get("IFS"))) ifs = " \t\n";
+    for (i = start = 0; i < n; i++) {
+        if (!strchr(ifs, s[i]) || !s[i]) continue;
+        field_raw(f, s + start, i - start);
+        // a non-blank separator delimits a field even if it is empty
+        if (!strchr(" \t\n", s[i])) f->open = 1;
+        field_end(f);
+        start = i + 1;
+    }
+    field_raw(f, s + start, n - start);
+}
+
+static void expand_error (char *what, char *word, char *end) {
+    fprintf(stderr, "error: %s: %.*s\n", what, (int) (end - word), word);
+}
+
+// find the character closing the bracket at p, skipping quoted text
+static char *group_end (char *p) {
+    char open = *p, close = open == '{' ? '}' : ')';
+    int depth = 0;
+
+    for (; *p; p++) {
+        if (*p == '\\' && p[1]) p++;
+        else if (*p == '\'' && strchr(p + 1, '\'')) p = strchr(p + 1, '\'');
+        else if (*p == open) depth++;
+        else if (*p == close && --depth == 0) return p;
+    }
+    return NULL;
+}
+
+// the pattern of an expansion operator; a word without quotes or expansions
+// is its own pattern, so the common case doesn't allocate
+static struct pattern *word_pattern (char *p, char *end) {
+    struct fields f;
+    struct pattern *pat;
+    char *q;
+
+    for (q = p; q < end && !strchr("'\"$", *q); q++);
+    if (q == end) return pat_get(p, end - p);
+
+    memset(&f, 0, sizeof(struct fields));
+    f.pattern = 1;
+    if (expand(&f, p, end) == -1) {
+        free(f.cur.s);
+        return NULL;
+    }
+    pat = pat_get(f.cur.s ? f.cur.s : "", f.cur.len);
+    free(f.cur.s);
+    return pat;
+}
+
+// add value with the matches of pat replaced by the expansion of the word
+// rep[0..end): the first one, all of them ('/'), or a match anchored at the
+// start ('#') or at the end ('%')
+static int replace (struct fields *f, char *value, struct pattern *pat, char *rep, char *end, int how, int quoted) {
+    struct fields r;
+    size_t n = strlen(value), len;
+    long i;
+
+    memset(&r, 0, sizeof(struct fields));
+    if (expand(&r, rep, end) == -1) {
+        free(r.cur.s);
+        return -1;
+    }
+    if (how == '#' || how == '%') {
+        i = how == '#' ? pat_prefix(pat, value, n, 1) : pat_suffix(pat, value, n, 1);
+        if (i >= 0) {
+            len = how == '#' ? (size_t) i : n - i;
+            i = how == '#' ? 0 : i;
+        }
+    }
+    while (n && (how == '#' || how == '%' || (i = pat_find(pat, value, n, &len)) >= 0)) {
+        if (i < 0) break;
+        field_add(f, value, i, quoted);
+        field_add(f, r.cur.s ? r.cur.s : "", r.cur.len, quoted);
+        // an empty match leaves the next character in place
+        if (!len && (size_t) i < n) field_add(f, value + i, ++len, quoted);
+        value += i + len;
+        n -= i + len;
+        if (how != '/') break;
+    }
+    field_add(f, value, n, quoted);
+    free(r.cur.s);
+    return 0;
+}
+
+// add the elements of an array: each as a field of its own for "${name[@]}",
+// joined by the first character of $IFS for "${name[*]}", or their number
+static int expand_elems (struct fields *f, char *name, size_t len, char how, int length, int quoted) {
+    char **elems, *ifs;
+    size_t n, i;
+
+    elems = var_getall(name, len, &n);
+    if (length) {
+        char num[3 * sizeof(size_t) + 1];
+
+        field_add(f, num, sprintf(num, "%zu", n), quoted);
+        return 0;
+    }
+    if (!(ifs = var_get("IFS"))) ifs = " ";
+    // without field splitting, as in an assignment, they are joined by spaces
+    if (!f->split && (!quoted || how == '@')) ifs = " ";
+    for (i = 0; i < n; i++) {
+        if (i && (!f->split || (quoted && how == '*'))) {
+            if (*ifs) field_lit(f, ifs, 1, quoted);
+        } else if (i) {
+            f->open = quoted;
+            field_end(f);
+        }
+        field_add(f, elems[i], strlen(elems[i]), quoted);
+    }
+    return 0;
+}
+
+// expand ${...} at p; returns the position after it
+static char *expand_brace (struct fields *f, char *p, int quoted) {
+    char *name = p + 2, *end = group_end(p + 1), *op, *value;
+    struct pattern *pat;
+    size_t len, n;
+    long long index;
+    long i;
+    int length = 0;
+
+    if (!end) {
+        expand_error("bad substitution", p, p + strlen(p));
+        return NULL;
+    }
+    // ${#name} is the length of the value
+    if (*name == '#' && name + 1 < end) {
+        length = 1;
+        name++;
+    }
+    len = *name == '?' ? 1 : var_namelen(name);
+    op = name + len;
+    if (len && *op == '[') {
+        char *sub = op + 1, *close = memchr(sub, ']', end - sub);
+
+        if (!close) {
+            expand_error("bad substitution", p, end + 1);
+            return NULL;
+        }
+        op = close + 1;
+        // ${name[@]} and ${name[*]} are all the elements of an array
+        if (close == sub + 1 && (*sub == '@' || *sub == '*')) {
+            if (op != end) {
+                expand_error("bad substitution", p, end + 1);
+                return NULL;
+            }
+            return expand_elems(f, name, len, *sub, length, quoted) == -1 ? NULL : end + 1;
+        }
+        if (arith(sub, close - sub, &index) == -1) return NULL;
+        value = var_geti(name, len, index);
+    } else {
+        value = var_getn(name, len);
+    }
+    if (!len || (length && op != end)) {
+        expand_error("bad substitution", p, end + 1);
+        return NULL;
+    }
+
+    if (length) {
+        char num[3 * sizeof(size_t) + 1];
+
+        n = sprintf(num, "%zu", value ? strlen(value) : 0);
+        field_add(f, num, n, quoted);
+        return end + 1;
+    }
+    if (op == end) {
+        if (value) field_add(f, value, strlen(value), quoted);
+        return end + 1;
+    }
+
+    // ${name:-word}, ${name:=word}, ${name:+word} and their variants
+    // without ':', which only test whether name is set
+    i = *op == ':';
+    if (strchr("-=+", op[i])) {
+        int unset = !value || (i && !*value);
+        int split = f->split;
+
+        if (op[i] == '+' ? unset : !unset) {
+            if (op[i] != '+') field_add(f, value, strlen(value), quoted);
+            return end + 1;
+        }
+        if (op[i] == '=') {
+            char *word = expand_word_n(op + i + 1, end);
+
+            if (!word) return NULL;
+            var_setn(name, len, word, 0);
+            field_add(f, word, strlen(word), quoted);
+            free(word);
+            return end + 1;
+        }
+        if (quoted) f->split = 0;
+        i = expand(f, op + i + 1, end);
+        f->split = split;
+        return i == -1 ? NULL : end + 1;
+    }
+
+    if (!value) value = "";
+    n = strlen(value);
+
+    // ${name:offset} and ${name:offset:length}
+    if (*op == ':') {
+        long off, cnt;
+        char *num = op + 1;
+
+        off = strtol(num, &num, 10);
+        cnt = *num == ':' ? strtol(num + 1, &num, 10) : (long) n;
+        if (num != end) {
+            expand_error("bad substitution", p, end + 1);
+            return NULL;
+        }
+        if (off < 0) off += n;
+        if (off < 0 || (size_t) off > n) off = n;
+        if (cnt < 0) cnt += n - off;
+        if (cnt < 0) cnt = 0;
+        if ((size_t) (off + cnt) > n) cnt = n - off;
+        field_add(f, value + off, cnt, quoted);
+        return end + 1;
+    }
+
+    // ${name#pattern}, ${name##pattern}, ${name%pattern}, ${name%%pattern},
+    // ${name/pattern/string} and its //, /# and /% variants
+    if (*op == '#' || *op == '%') {
+        int longest = op[1] == *op;
+
+        if (!(pat = word_pattern(op + 1 + longest, end))) return NULL;
+        if (*op == '#') {
+            i = pat_prefix(pat, value, n, longest);
+            if (i < 0) i = 0;
+            field_add(f, value + i, n - i, quoted);
+        } else {
+            i = pat_suffix(pat, value, n, longest);
+            if (i < 0) i = n;
+            field_add(f, value, i, quoted);
+        }
+        return end + 1;
+    }
+    if (*op == '/') {
+        int how = strchr("/#%", op[1]) ? op[1] : 0;
+        char *rep = op + 1 + !!how;
+
+        // the pattern ends at the first unescaped '/'
+        while (rep < end && *rep != '/') rep += *rep == '\\' && rep + 1 < end ? 2 : 1;
+        if (!(pat = word_pattern(op + 1 + !!how, rep))) return NULL;
+        if (replace(f, value, pat, rep + (rep < end), end, how, quoted) == -1) return NULL;
+        return end + 1;
+    }
+
+    expand_error("bad substitution", p, end + 1);
+    return NULL;
+}
+
+// expand $((expression)) at p, whose closing parentheses are at end
+static char *expand_arith (struct fields *f, char *p, char *end, int quoted) {
+    char *text = p + 3, *q, num[32];
+    long long value;
+    int n;
+
+    // $name and ${name} are compiled into the expression, so that its text
+    // doesn't change between evaluations; anything else is expanded first
+    for (q = text; q < end - 1; q++) {
+        if (*q == '$' && q[1] == '{' && (q + 2 + var_namelen(q + 2) >= end || q[2 + var_namelen(q + 2)] != '}')) break;
+        if (*q == '$' && q[1] == '(') break;
+        if (strchr("'\"\\`", *q)) break;
+    }
+    if (q < end - 1) {
+        struct fields e;
+
+        memset(&e, 0, sizeof(struct fields));
+        if (expand(&e, text, end - 1) == -1) {
+            free(e.cur.s);
+            return NULL;
+        }
+        n = arith(e.cur.s ? e.cur.s : "", e.cur.len, &value);
+        free(e.cur.s);
+    } else {
+        n = arith(text, end - 1 - text, &value);
+    }
+    if (n == -1) return NULL;
+
+    n = sprintf(num, "%lld", value);
+    field_add(f, num, n, quoted);
+    return end + 1;
+}
+
+// the parsed commands of the last substitutions, so that a substitution
+// run in a loop is only parsed once
+#define SUBST_CACHE 64
+
+static struct {
+    char *text;
+    struct cmd *cmd;
+} substs[SUBST_CACHE];
+static int nextsubst;
+
+// the parsed command of the substitution text p[0..len)
+static struct cmd *subst_parse (char *p, size_t len) {
+    struct cmd *cmd;
+    char *text;
+    int i;
+
+    for (i = 0; i < SUBST_CACHE && substs[i].text; i++) {
+        if (!strncmp(substs[i].text, p, len) && !substs[i].text[len]) {
+            return substs[i].cmd;
+        }
+    }
+    text = strndup(p, len);
+    if (!(cmd = parser(text, 0))) {
+        free(text);
+        return NULL;
+    }
+    free(substs[nextsubst].text);
+    substs[nextsubst].text = text;
+    substs[nextsubst].cmd = cmd;
+    nextsubst = (nextsubst + 1) % SUBST_CACHE;
+    return cmd;
+}
+
+// expand $(command) at p, whose closing parenthesis is at end
+static char *expand_command (struct fields *f, char *p, char *end, int quoted) {
+    struct buf out;
+    struct cmd *cmd;
+
+    if (!(cmd = subst_parse(p + 2, end - p - 2))) return NULL;
+
+    memset(&out, 0, sizeof(struct buf));
+    substitute(cmd, &out);
+    // the trailing newlines are removed
+    while (out.len && out.s[out.len - 1] == '\n') out.len--;
+    field_add(f, out.s, out.len, quoted);
+    free(out.s);
+    return end + 1;
+}
+
+// expand the process substitution <(command) or >(command) at p into the
+// name of the pipe connected to the command, which runs meanwhile
+static char *expand_process (struct fields *f, char *p, char *end) {
+    struct cmd *cmd;
+    char name[32];
+    int fd;
+
+    if (!(cmd = subst_parse(p + 2, end - p - 2))) return NULL;
+    if ((fd = procsub(cmd, *p == '>')) == -1) return NULL;
+    snprintf(name, sizeof(name), "/dev/fd/%d", fd);
+    field_lit(f, name, strlen(name), 1);
+    return end + 1;
+}
+
+// expand the parameter at p (pointing to a '$'); returns the position after it
+static char *expand_dollar (struct fields *f, char *p, int quoted) {
+    char *name = p + 1, *value, *end;
+    size_t len;
+
+    if (*name == '{') {
+        return expand_brace(f, p, quoted);
+    } else if (*name == '(' && name[1] == '(' && (end = group_end(name))
+            && end[-1] == ')' && group_end(name + 1) == end - 1) {
+        return expand_arith(f, p, end, quoted);
+    } else if (*name == '(') {
+        if (!(end = group_end(name))) {
+            expand_error("bad substitution", p, p + strlen(p));
+            return NULL;
+        }
+        return expand_command(f, p, end, quoted);
+    } else if (*name == '?') {
+        len = 1;
+        p = name + 1;
+    } else if ((len = var_namelen(name))) {
+        p = name + len;
+    } else {
+        // a lone '$' stands for itself
+        field_raw(f, "$", 1);
+        return p + 1;
+    }
+
+    if ((value = var_getn(name, len))) {
+        field_add(f, value, strlen(value), quoted);
+    }
+    return p;
+}
+
+// expand the word p[0..end) into f
+static int expand (struct fields *f, char *p, char *end) {
+    while (p < end) {
+        switch (*p) {
+            case '\'': {
+                char *close = memchr(p + 1, '\'', end - p - 1);
+
+                if (!close) close = end;
+                field_lit(f, p + 1, close - p - 1, 1);
+                f->open = 1;
+                p = close + 1;
+                break;
+            }
+
+            case '"':
+                f->open = 1;
+                for (p++; p < end && *p != '"'; ) {
+                    if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+                        p += 2;     // a line continuation
+                    } else if (*p == '\\' && p + 1 < end && strchr("$`\"\\", p[1])) {
+                        field_lit(f, p + 1, 1, 1);
+                        p += 2;
+                    } else if (*p == '$') {
+                        if (!(p = expand_dollar(f, p, 1))) return -1;
+                    } else {
+                        field_lit(f, p++, 1, 1);
+                    }
+                }
+                if (p < end) p++;
+                break;
+
+            case '\\':
+                if (p + 1 < end && p[1] == '\n') {
+                    p += 2;     // a line continuation
+                    break;
+                }
+                if (p + 1 < end) p++;
+                field_lit(f, p++, 1, 1);
+                break;
+
+            case '$':
+                if (!(p = expand_dollar(f, p, 0))) return -1;
+                break;
+
+            case '<':
+            case '>': {
+                char *close;
+
+                // the scanner only leaves these in a process substitution
+                if (p[1] != '(' || !(close = group_end(p + 1))) {
+                    field_raw(f, p++, 1);
+                    break;
+                }
+                if (!(p = expand_process(f, p, close))) return -1;
+                break;
+            }
+
+            default:
+                field_raw(f, p++, 1);
+        }
+    }
+    return 0;
+}
+
+// Brace expansion.  The words a word with braces stands for are generated
+// one at a time into a buffer and expanded into the fields right away, so
+// that {1..100000} never exists as a list of strings.  The text left to
+// generate is a chain of segments on the stack.
+struct segment {
+    char *p, *end;
+    struct segment *next;
+};
+
+// find the brace closing the one at p (before end), skipping quoted text
+// and expansions; *comma is set if it has a comma at its top level
+static char *brace_end (char *p, char *end, int *comma) {
+    int depth = 0;
+
+    *comma = 0;
+    for (; p < end; p++) {
+        if (*p == '\\' && p + 1 < end) p++;
+        else if (*p == '\'' && memchr(p + 1, '\'', end - p - 1)) p = memchr(p + 1, '\'', end - p - 1);
+        else if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++) if (*p == '\\') p++;
+        }
+        else if (*p == '$' && p + 1 < end && (p[1] == '{' || p[1] == '(')) {
+            char *close = group_end(p + 1);
+
+            if (!close || close >= end) return NULL;
+            p = close;
+        }
+        else if (*p == '{') depth++;
+        else if (*p == '}' && --depth == 0) return p;
+        else if (*p == ',' && depth == 1) *comma = 1;
+    }
+    return NULL;
+}
+
+// parse the sequence x..y or x..y..step of p[0..n), made of integers or of
+// single letters; *width is set to the width of zero-padded integers
+static int brace_seq (char *p, size_t n, long *from, long *to, long *step, int *width, int *letters) {
+    char *s = strndup(p, n), *q = s, *e;
+    int ok = 0, w;
+
+    *step = 1;
+    *width = 0;
+    *letters = 0;
+    if (isalpha((unsigned char) q[0]) && q[1] == '.' && q[2] == '.' && isalpha((unsigned char) q[3])) {
+        *letters = 1;
+        *from = q[0];
+        *to = q[3];
+        q += 4;
+    } else {
+        *from = strtol(q, &e, 10);
+        if (e == q || e[0] != '.' || e[1] != '.') goto done;
+        w = e - q;
+        if ((q[0] == '0' || (q[0] == '-' && q[1] == '0')) && w > 1) *width = w;
+        q = e + 2;
+        *to = strtol(q, &e, 10);
+        if (e == q) goto done;
+        w = e - q;
+        if ((q[0] == '0' || (q[0] == '-' && q[1] == '0')) && w > 1 && w > *width) *width = w;
+        q = e;
+    }
+    if (q[0] == '.' && q[1] == '.') {
+        *step = strtol(q + 2, &e, 10);
+        if (e == q + 2) goto done;
+        q = e;
+    }
+    if (*step < 0) *step = -*step;
+    if (*step == 0) *step = 1;
+    ok = !*q;
+done:
+    free(s);
+    return ok;
+}
+
+// generate the words of the segments into b, expanding each into f
+static int brace_gen (struct fields *f, struct buf *b, struct segment *seg) {
+    size_t len = b->len;
+    char *p, *open, *close = NULL;
+    int comma = 0, r = 0;
+    long from, to, step, i;
+    int width, letters;
+
+    if (!seg) {
+        r = expand(f, b->s, b->s + b->len);
+        field_end(f);
+        return r;
+    }
+
+    // the first brace holding a list or a sequence
+    for (p = seg->p; ; p = open + 1) {
+        for (open = p; open < seg->end && *open != '{'; open++) {
+            if (*open == '\\' && open + 1 < seg->end) open++;
+            else if (*open == '\'' && memchr(open + 1, '\'', seg->end - open - 1)) open = memchr(open + 1, '\'', seg->end - open - 1);
+            else if (*open == '"') {
+                for (open++; open < seg->end && *open != '"'; open++) if (*open == '\\') open++;
+            }
+            else if (*open == '$' && open + 1 < seg->end && (open[1] == '{' || open[1] == '(')) {
+                char *c = group_end(open + 1);
+
+                open = c && c < seg->end ? c : seg->end - 1;
+            }
+        }
+        if (open >= seg->end) break;
+        if (!(close = brace_end(open, seg->end, &comma))) {
+            open = seg->end;
+            break;
+        }
+        if (comma || brace_seq(open + 1, close - open - 1, &from, &to, &step, &width, &letters)) break;
+    }
+
+    if (open >= seg->end) {
+        buf_add(b, seg->p, seg->end - seg->p);
+        r = brace_gen(f, b, seg->next);
+    } else {
+        struct segment rest = { close + 1, seg->end, seg->next };
+
+        buf_add(b, seg->p, open - seg->p);
+        if (comma) {
+            char *a = open + 1, *q;
+            int ignored;
+
+            // the alternatives end at the commas of the top level
+            for (q = a; r != -1; q++) {
+                if (q < close && *q == '{' && (p = brace_end(q, close, &ignored))) {
+                    q = p;
+                } else if (q < close && *q == '\\' && q + 1 < close) {
+                    q++;
+                } else if (q == close || *q == ',') {
+                    struct segment alt = { a, q, &rest };
+
+                    r = brace_gen(f, b, &alt);
+                    b->len = len + (open - seg->p);
+                    if (q == close) break;
+                    a = q + 1;
+                }
+            }
+        } else {
+            char num[32];
+            size_t base = b->len;
+
+            for (i = from; r != -1 && (from <= to ? i <= to : i >= to); i += from <= to ? step : -step) {
+                if (letters) buf_addc(b, (char) i);
+                else buf_add(b, num, sprintf(num, "%0*ld", width, i));
+                r = brace_gen(f, b, &rest);
+                b->len = base;
+            }
+        }
+    }
+    b->len = len;
+    if (b->s) b->s[len] = 0;
+    return r;
+}
+
+void free_args (char **args) {
+    int i;
+
+    if (!args) return;
+    for (i = 0; args[i]; i++) free(args[i]);
+    free(args);
+}
+
+// expand a NULL-terminated list of words into the argument vector of a
+// command; returns NULL if an expansion failed.  If ends isn't NULL, ends[i]
+// is set to the index of the field following those of the i-th word
+char **expand_args (char **words, int *ends) {
+    struct fields f;
+    int i;
+
+    memset(&f, 0, sizeof(struct fields));
+    f.split = 1;
+    f.glob = 1;
+    f.v = calloc(f.cap = 8, sizeof(char*));
+    for (i = 0; words[i]; i++) {
+        int r;
+
+        if (strchr(words[i], '{')) {
+            struct segment word = { words[i], words[i] + strlen(words[i]), NULL };
+            struct buf b;
+
+            memset(&b, 0, sizeof(struct buf));
+            r = brace_gen(&f, &b, &word);
+            free(b.s);
+        } else {
+            r = expand(&f, words[i], words[i] + strlen(words[i]));
+            field_end(&f);
+        }
+        if (r == -1) {
+            free(f.cur.s);
+            free(f.pat.s);
+            free_args(f.v);
+            return NULL;
+        }
+        if (ends) ends[i] = f.n;
+    }
+    return f.v;
+}
+
+// expand the word p[0..end) without field splitting
+static char *expand_word_n (char *p, char *end) {
+    struct fields f;
+
+    memset(&f, 0, sizeof(struct fields));
+    if (expand(&f, p, end) == -1) {
+        free(f.cur.s);
+        return NULL;
+    }
+    return f.cur.s ? f.cur.s : strdup("");
+}
+
+// the glob pattern a word expands to, as for the items of a case command;
+// the pattern belongs to the cache of pattern.c
+struct pattern *expand_pattern (char *word) {
+    return word_pattern(word, word + strlen(word));
+}
+
+// the extended regular expression a word expands to, its quoted parts
+// matching literally
+char *expand_regex (char *word) {
+    struct fields f;
+
+    memset(&f, 0, sizeof(struct fields));
+    f.pattern = 2;
+    if (expand(&f, word, word + strlen(word)) == -1) {
+        free(f.cur.s);
+        return NULL;
+    }
+    return f.cur.s ? f.cur.s : strdup("");
+}
+
+// expand a single word without field splitting, as for the target of a
+// redirection or the value of an assignment
+char *expand_word (char *word) {
+    return expand_word_n(word, word + strlen(word));
+}
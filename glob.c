@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "global.h"
+
+// Pathname expansion.  A pattern is matched one component at a time against
+// the listings of the directories it goes through.  The listings are read
+// with getdents64 and kept in a cache keyed by the path of the directory,
+// used again as long as the modification time of the directory is the one
+// it had when read, so that the globs of a script over a large directory
+// only read it once.  A ** component matches any number of directories;
+// the trees it goes through are walked by walk.c.
+
+#define DIR_CACHE 64
+#define DENTS_SIZE 65536
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct entry {
+    char *name;
+    unsigned char type;         // the DT_ type, or DT_UNKNOWN
+};
+
+struct dirlist {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int racy;                   // modified in the second it was read: a later
+                                // change might not show in the mtime
+    struct entry *entry;        // sorted by name, without . and ..
+    size_t n;
+    char *names;                // storage of the names
+};
+
+// the listings, the most recently used first
+static struct dirlist *cache[DIR_CACHE];
+static int cached;
+
+// a growable list of paths
+struct paths {
+    char **v;
+    size_t n;
+    size_t cap;
+};
+
+static void paths_add (struct paths *p, char *path) {
+    if (p->n + 1 >= p->cap) {
+        p->cap = p->cap ? 2 * p->cap : 16;
+        p->v = realloc(p->v, p->cap * sizeof(char*));
+    }
+    p->v[p->n++] = path;
+}
+
+static void paths_free (struct paths *p) {
+    size_t i;
+
+    for (i = 0; i < p->n; i++) free(p->v[i]);
+    free(p->v);
+    memset(p, 0, sizeof(struct paths));
+}
+
+static void dir_free (struct dirlist *d) {
+    free(d->path);
+    free(d->entry);
+    free(d->names);
+    free(d);
+}
+
+static int entry_cmp (const void *a, const void *b) {
+    return strcmp(((struct entry*) a)->name, ((struct entry*) b)->name);
+}
+
+// read the listing of the directory path, whose status is st
+static struct dirlist *dir_read (const char *path, struct stat *st) {
+    struct dirlist *d;
+    struct buf names;
+    struct timespec now;
+    size_t *offs = NULL, i, cap = 0;
+    long nread, off;
+    char *dents;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) return NULL;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    d = calloc(1, sizeof(struct dirlist));
+    memset(&names, 0, sizeof(struct buf));
+    dents = malloc(DENTS_SIZE);
+    while ((nread = syscall(SYS_getdents64, fd, dents, DENTS_SIZE)) > 0) {
+        for (off = 0; off < nread; off += ((struct linux_dirent64*) (dents + off))->d_reclen) {
+            struct linux_dirent64 *e = (struct linux_dirent64*) (dents + off);
+
+            if (e->d_name[0] == '.' && (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2]))) {
+                continue;
+            }
+            if (d->n == cap) {
+                cap = cap ? 2 * cap : 64;
+                offs = realloc(offs, cap * sizeof(size_t));
+                d->entry = realloc(d->entry, cap * sizeof(struct entry));
+            }
+            offs[d->n] = names.len;
+            d->entry[d->n++].type = e->d_type;
+            buf_add(&names, e->d_name, strlen(e->d_name) + 1);
+        }
+    }
+    free(dents);
+    close(fd);
+
+    // the names are only placed once the block has stopped moving
+    for (i = 0; i < d->n; i++) d->entry[i].name = names.s + offs[i];
+    free(offs);
+    qsort(d->entry, d->n, sizeof(struct entry), entry_cmp);
+
+    d->path = strdup(path);
+    d->names = names.s;
+    d->dev = st->st_dev;
+    d->ino = st->st_ino;
+    d->mtime = st->st_mtim;
+    d->racy = st->st_mtim.tv_sec >= now.tv_sec - 1;
+    return d;
+}
+
+// return the listing of the directory path, reading it unless the cached
+// one is still up to date
+static struct dirlist *dir_get (const char *path) {
+    struct dirlist *d;
+    struct stat st;
+    int i;
+
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) return NULL;
+    for (i = 0; i < cached; i++) {
+        d = cache[i];
+        if (strcmp(d->path, path)) continue;
+        if (!d->racy && d->dev == st.st_dev && d->ino == st.st_ino
+                && d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            memmove(cache + 1, cache, i * sizeof(struct dirlist*));
+            return cache[0] = d;
+        }
+        // out of date
+        dir_free(d);
+        memmove(cache + i, cache + i + 1, (--cached - i) * sizeof(struct dirlist*));
+        break;
+    }
+    if (!(d = dir_read(path, &st))) return NULL;
+    if (cached == DIR_CACHE) dir_free(cache[--cached]);
+    memmove(cache + 1, cache, cached++ * sizeof(struct dirlist*));
+    return cache[0] = d;
+}
+
+// whether the pattern component s[0..n) has unescaped glob characters
+static int has_glob (const char *s, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (s[i] == '\\') i++;
+        else if (strchr("*?[", s[i])) return 1;
+    }
+    return 0;
+}
+
+// path followed by the component name[0..n)
+static char *join (const char *path, const char *name, size_t n) {
+    size_t len = strlen(path);
+    char *s = malloc(len + n + 2), *e = s + len;
+
+    memcpy(s, path, len);
+    if (len && path[len - 1] != '/') *e++ = '/';
+    memcpy(e, name, n);
+    e[n] = 0;
+    return s;
+}
+
+// add to out the paths of the entries of dir matching the component
+// comp[0..n); only directories are kept if more components follow
+static void glob_dir (struct paths *out, const char *dir, const char *comp, size_t n, int more) {
+    struct dirlist *d = dir_get(*dir ? dir : ".");
+    struct pattern *pat;
+    size_t i;
+    int dot;
+
+    if (!d) return;
+    pat = pat_get(comp, n);
+    // names starting with a dot are only matched by a literal dot
+    dot = comp[0] == '.' || (comp[0] == '\\' && comp[1] == '.');
+    for (i = 0; i < d->n; i++) {
+        struct entry *e = &d->entry[i];
+
+        if (e->name[0] == '.' && !dot) continue;
+        if (more && e->type != DT_DIR && e->type != DT_LNK && e->type != DT_UNKNOWN) continue;
+        if (pat_match(pat, e->name, strlen(e->name))) {
+            paths_add(out, join(dir, e->name, strlen(e->name)));
+        }
+    }
+}
+
+static int path_cmp (const void *a, const void *b) {
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+// expand the component ** (whose end is at end) for each path of cur into
+// out, walking the trees below them in parallel (see walk.c); returns the
+// end of the components consumed
+static const char *glob_tree (struct paths *out, struct paths *cur, const char *end) {
+    struct pattern *pat = NULL;
+    const char *next = end, *last;
+    int flags = 0;
+    size_t i, j, n;
+
+    while (*next == '/') next++;
+    last = next + strcspn(next, "/");
+    if (!*end) {
+        // a final ** is all the files and directories below
+    } else if (*next && !*last) {
+        // **/name: the matching names at any depth, found during the walk
+        pat = pat_get(next, last - next);
+        if (*next == '.' || (next[0] == '\\' && next[1] == '.')) flags |= WALK_DOT;
+        end = last;
+    } else {
+        // **/ followed by more components: the directories at any depth,
+        // including the starting one
+        flags |= WALK_DIRS;
+        for (i = 0; i < cur->n; i++) paths_add(out, strdup(cur->v[i]));
+    }
+    for (i = 0; i < cur->n; i++) {
+        char **found = walk_tree(cur->v[i], pat, flags, &n);
+
+        for (j = 0; j < n; j++) paths_add(out, found[j]);
+        free(found);
+    }
+    return end;
+}
+
+// return the sorted NULL-terminated list of the paths matching the pattern,
+// or NULL if there are none
+char **glob_expand (const char *pattern) {
+    struct paths cur, next;
+    const char *p = pattern, *end;
+    int checked = 1;
+    size_t i;
+
+    memset(&cur, 0, sizeof(struct paths));
+    paths_add(&cur, strdup(*p == '/' ? "/" : ""));
+    while (*p == '/') p++;
+
+    while (*p && cur.n) {
+        size_t n;
+        int more;
+
+        end = strchr(p, '/');
+        if (!end) end = p + strlen(p);
+        n = end - p;
+        more = *end != 0;
+
+        memset(&next, 0, sizeof(struct paths));
+        if (n == 2 && p[0] == '*' && p[1] == '*') {
+            end = glob_tree(&next, &cur, end);
+            checked = 1;
+        } else if (has_glob(p, n)) {
+            for (i = 0; i < cur.n; i++) glob_dir(&next, cur.v[i], p, n, more);
+            checked = 1;
+        } else {
+            // a literal component, whose existence is checked at the end
+            char *lit = malloc(n + 1), *l = lit;
+            const char *s;
+
+            for (s = p; s < end; s++) {
+                if (*s == '\\' && s + 1 < end) s++;
+                *l++ = *s;
+            }
+            for (i = 0; i < cur.n; i++) paths_add(&next, join(cur.v[i], lit, l - lit));
+            free(lit);
+            checked = 0;
+        }
+        paths_free(&cur);
+        cur = next;
+
+        // a trailing slash only keeps the directories
+        for (p = end; *p == '/'; p++);
+        if (end != p && !*p) {
+            for (i = 0; i < cur.n; i++) {
+                char *s = join(cur.v[i], "", 0);
+
+                free(cur.v[i]);
+                cur.v[i] = s;
+            }
+            checked = 0;
+        }
+    }
+
+    if (!checked) {
+        struct stat st;
+        size_t n = 0;
+
+        for (i = 0; i < cur.n; i++) {
+            if (lstat(cur.v[i], &st) == 0) cur.v[n++] = cur.v[i];
+            else free(cur.v[i]);
+        }
+        cur.n = n;
+    }
+    if (!cur.n) {
+        paths_free(&cur);
+        return NULL;
+    }
+    qsort(cur.v, cur.n, sizeof(char*), path_cmp);
+    cur.v[cur.n] = NULL;
+    return cur.v;
+}
@@ -1,15 +1,41 @@
-typedef enum { C_PLAIN, C_VOID, C_AND, C_OR, C_PIPE, C_SEQ } cmdtype;
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+
+typedef enum { C_PLAIN, C_VOID, C_AND, C_OR, C_PIPE, C_SEQ, C_CASE, C_TEST, C_MERGE, C_CONCAT } cmdtype;
 
 struct cmd {
 	int type;
 	struct cmd *left;
 	struct cmd *right;
 
+	char **assigns;
 	char **args;
 	char *input;
 	char *output;
 	char *append;
 	char *error;
+	char *here;	// word expanding to the input of a here-document
+	int zip;	// the redirections compressed: ZIP_INPUT, ...
+	struct cases *cases;	// the alternatives of a C_CASE
+};
+
+#define ZIP_INPUT 1
+#define ZIP_OUTPUT 2
+#define ZIP_APPEND 4
+
+// an alternative of a case command
+struct casearm {
+	char **pats;		// its pattern words
+	char **dynamic;		// those to be expanded when the command runs
+	struct cmd *body;	// NULL if empty
+};
+
+struct cases {
+	char *word;		// the word matched against the patterns
+	struct casearm *arm;
+	int n;
+	struct patset *set;	// the patterns known when parsing, compiled
 };
 
 struct arglist {
@@ -17,5 +43,143 @@ struct arglist {
 	struct arglist *next;
 };
 
-extern struct cmd* parser (char*);
+// growable string, kept NUL-terminated
+struct buf {
+	char *s;
+	size_t len;
+	size_t cap;
+};
+
+// compiled glob pattern (pattern.c)
+enum { P_EXACT, P_PREFIX, P_SUFFIX, P_INFIX, P_GLOB };
+
+struct pattern {
+	int kind;		// P_GLOB, or literal with stars around it
+	char *text;		// source of the pattern
+	size_t textlen;
+	char *lit;		// the literal of the other kinds
+	size_t litlen;
+	struct pnode *node;	// the program of P_GLOB
+	int nnodes;
+	size_t minlen;		// length of the shortest matching string
+};
+
+extern struct cmd* parser (char*,int);
+extern int execute (struct cmd*);
+extern int exec_tail;
+extern int builtin_exec (char**);
+extern int builtin_replicate (char**);
+extern int builtin_pipestats (char**);
+extern int parse_incomplete;
 extern void output (struct cmd*,int);
+extern int substitute (struct cmd*,struct buf*);
+extern int cmdsubs;
+extern int procsub (struct cmd*,int);
+
+// shell variables (var.c)
+#define V_EXPORT 1
+
+extern int laststatus;
+extern void var_init (char**);
+extern size_t var_namelen (const char*);
+extern char* var_get (const char*);
+extern char* var_getn (const char*,size_t);
+extern int var_set (const char*,const char*,int);
+extern int var_setn (const char*,size_t,const char*,int);
+extern int var_unset (const char*);
+extern int var_seta (const char*,char**,size_t);
+extern char** var_getall (const char*,size_t,size_t*);
+extern char* var_geti (const char*,size_t,long);
+extern char** var_environ (void);
+extern size_t var_envsize (void);
+extern char** var_overlay (char**);
+extern void var_overlay_free (char**);
+
+// word expansion (expand.c)
+extern void buf_add (struct buf*,const char*,size_t);
+extern void buf_addc (struct buf*,char);
+extern int buf_read (struct buf*,int);
+extern char** expand_args (char**,int*);
+extern char* expand_word (char*);
+extern struct pattern* expand_pattern (char*);
+extern char* expand_regex (char*);
+extern void free_args (char**);
+
+// glob patterns (pattern.c)
+extern struct pattern* pat_compile (const char*,size_t);
+extern struct pattern* pat_get (const char*,size_t);
+extern void pat_free (struct pattern*);
+extern int pat_match (struct pattern*,const char*,size_t);
+extern long pat_prefix (struct pattern*,const char*,size_t,int);
+extern long pat_suffix (struct pattern*,const char*,size_t,int);
+extern long pat_find (struct pattern*,const char*,size_t,size_t*);
+extern struct patset* patset_new (void);
+extern void patset_add (struct patset*,struct pattern*,int);
+extern int patset_match (struct patset*,const char*,size_t);
+
+// pathname expansion (glob.c, walk.c)
+#define WALK_DIRS 1
+#define WALK_DOT 2
+
+extern char** glob_expand (const char*);
+extern char** walk_tree (const char*,struct pattern*,int,size_t*);
+
+// arithmetic expansion (arith.c)
+extern int arith (const char*,size_t,long long*);
+
+// [[ ... ]] tests (test.c)
+extern int test_eval (char**);
+
+// builtin commands (builtin.c)
+typedef int builtin_fn (char**);
+extern struct buf *capture;
+extern int opt_batch;
+extern int opt_pipegrow;
+extern int opt_pipestats;
+extern int opt_parallel;
+extern builtin_fn* builtin_lookup (char**);
+extern builtin_fn* builtin_stage (char**);
+extern int builtin_sigint (builtin_fn*);
+extern int bi_write (const char*,size_t);
+extern int bi_outfd (void);
+extern long bi_read (char*,size_t);
+extern volatile sig_atomic_t bi_interrupted;
+extern void bi_catch (void);
+extern void bi_release (void);
+extern void bi_catch_threads (pthread_t*,int);
+
+// the ring buffers joining a builtin run as a stage of a pipeline to the
+// previous and next ones, NULL for the standard input and output, and the
+// pipe it writes to instead of its standard output, -1 if none
+struct stageio {
+	struct ring *in;
+	struct ring *out;
+	int outfd;
+	int broken;	// the reader of its output has gone
+};
+
+extern __thread struct stageio *bi_io;
+
+// the builtins reading their input (read.c)
+extern int stdin_owned;
+extern int builtin_read (char**);
+extern int builtin_mapfile (char**);
+
+// the builtins copying their input (copy.c)
+extern int builtin_tee (char**);
+extern int tee_takes (char**);
+extern int builtin_cat (char**);
+extern int cat_takes (char**);
+
+// the compressed redirections (zip.c)
+extern int nzips;
+extern int zip_start (int,int,int);
+extern int zip_done (int);
+
+// the ring buffers between builtins run as threads (ring.c)
+extern struct ring* ring_new (size_t);
+extern void ring_free (struct ring*);
+extern int ring_write (struct ring*,const char*,size_t);
+extern size_t ring_read (struct ring*,char*,size_t);
+extern void ring_close_write (struct ring*);
+extern void ring_close_read (struct ring*);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -6,94 +7,1410 @@
 #include <readline/history.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <glob.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 
 #include "global.h"
 
-// MAXDIGIT_INT: the maximum number of digits of int written in base 10
-// in a 64-bit machine
-#define MAXDIGIT_INT 19 
+extern char **environ;
 
 int execute (struct cmd *cmd);
 int executeAux (struct cmd *cmd);
+int redirect (struct cmd *cmd);
+int assign (char **assigns, int flags);
+char **overlay (char **assigns);
 void propagate (struct cmd *cmd);
 
 int main (int argc, char **argv) {
-    printf("welcome to lsvsh!\n");
+    // with -c, the shell runs the command given and exits
+    int interactive = !(argc > 2 && strcmp(argv[1], "-c") == 0);
 
-    // Initialize environment variables
+    if (interactive) printf("welcome to lsvsh!\n");
+
+    // Initialize the shell variables with the environment
+    var_init(environ);
 
     // PWD variable to store the present working directory
     char cwd[MAXPATHLEN + 1];
 
-    if (getcwd(cwd, MAXPATHLEN) == NULL) {
-        fprintf(stderr, "error: %s\n", strerror(errno));
-        fprintf(stderr, "cannot get current working directory\n");
-        exit (-1);
+    if (getcwd(cwd, MAXPATHLEN) == NULL) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        fprintf(stderr, "cannot get current working directory\n");
+        exit (-1);
+    }
+    if (var_set("PWD", cwd, V_EXPORT)) {
+        fprintf(stderr, "error: cannot create $PWD\n");
+        exit (-1);
+    }
+
+    if (!interactive) {
+        struct cmd *cmd = parser(argv[2], 0);
+
+        if (!cmd) return parse_incomplete || *argv[2] ? 2 : 0;
+        // nothing is left to do after the last command: it can replace
+        // the shell rather than run in a child
+        exec_tail = 1;
+        return execute(cmd);
+    }
+
+    // Ignore SIGINT (CTRL-C)
+    if (signal(SIGINT, SIG_IGN) == SIG_ERR) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+
+    while (1) {
+        int exitval;
+
+        char *line = readline ("shell> ");
+        if (!line) break;	// user pressed CTRL+D; quit shell
+        if (!*line) continue;	// empty line
+
+        // read more lines while the command is incomplete (open quotes,
+        // here-document bodies, trailing operator)
+        struct cmd *cmd;
+        while (!(cmd = parser(line, 1)) && parse_incomplete) {
+            char *more = readline ("> ");
+
+            if (!more) {
+                fprintf(stderr, "cannot parse input: unexpected end of input; discarded\n");
+                break;
+            }
+            line = realloc(line, strlen(line) + strlen(more) + 2);
+            strcat(strcat(line, "\n"), more);
+            free(more);
+        }
+
+        add_history (line);	// add line to history
+
+        if (!cmd) continue;	// some parse error occurred; ignore
+        
+        exitval = execute(cmd);
+        if (exitval == SIGINT) {
+            // print a newline if the program terminated with SIGINT
+            printf("\n");
+        }
+    }
+
+    printf("goodbye!\n");
+    return 0;
+}
+
+int execute (struct cmd *cmd) {
+    propagate(cmd);
+    return executeAux(cmd);
+}
+
+// number of command substitutions run so far
+int cmdsubs;
+
+// This function runs a command substitution: cmd is executed with its
+// standard output appended to out
+int substitute (struct cmd *cmd, struct buf *out) {
+    struct buf *saved = capture;
+    int retval, owned = stdin_owned;
+
+    // the command using the substitution may still read the input after it
+    cmdsubs++;
+    capture = out;
+    stdin_owned = 0;
+    retval = execute(cmd);
+    capture = saved;
+    stdin_owned = owned;
+    return retval;
+}
+
+// the largest pipe buffer an unprivileged process may ask for
+static long pipe_max (void) {
+    static long max;
+    FILE *f;
+
+    if (!max) {
+        if (!(f = fopen("/proc/sys/fs/pipe-max-size", "r")) || fscanf(f, "%ld", &max) != 1) max = 1 << 20;
+        if (f) fclose(f);
+    }
+    return max;
+}
+
+// the size asked for the pipes of the rest of the pipeline being run
+static long pipe_override;
+
+// This function returns the size of buffer to ask for the pipe of cmd, 0
+// for the kernel's default: the value of a PIPE_SIZE prefix assignment of
+// the first command of the pipeline, else of the variable PIPE_SIZE, in
+// bytes or with a K, M or G suffix, and at most the system's limit
+static long pipe_size (struct cmd *cmd) {
+    char *value = NULL, *end;
+    long size;
+    int i;
+
+    if (pipe_override) return pipe_override;
+    for (i = 0; cmd->left->type == C_PLAIN && cmd->left->assigns && cmd->left->assigns[i]; i++) {
+        if (!strncmp(cmd->left->assigns[i], "PIPE_SIZE=", 10)) {
+            free(value);
+            value = expand_word(cmd->left->assigns[i] + 10);
+        }
+    }
+    if (!value && !(value = var_get("PIPE_SIZE"))) return 0;
+    size = strtol(value, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': size <<= 10; break;
+        case 'm': case 'M': size <<= 20; break;
+        case 'g': case 'G': size <<= 30; break;
+    }
+    if (value != var_get("PIPE_SIZE")) free(value);
+    if (size <= 0) return 0;
+    return size < pipe_max() ? size : pipe_max();
+}
+
+// The adaptive sizing of a pipe ("set -o pipegrow"): a thread looks at how
+// full the pipe is every PIPE_SAMPLE_MS, and doubles its buffer, up to the
+// system's limit, once its writer was found stalled on a full pipe
+// PIPE_STALLS times in a row
+#define PIPE_SAMPLE_MS 5
+#define PIPE_STALLS 3
+
+struct pipewatch {
+    int fd;             // a copy of the read end of the pipe
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void *pipe_watch (void *arg) {
+    struct pipewatch *w = arg;
+    struct timespec t;
+    int stalls = 0, queued, size;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop) {
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_nsec += PIPE_SAMPLE_MS * 1000000L;
+        if (t.tv_nsec >= 1000000000L) {
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&w->cond, &w->lock, &t);
+        if (w->stop) break;
+        if ((size = fcntl(w->fd, F_GETPIPE_SZ)) <= 0 || ioctl(w->fd, FIONREAD, &queued) == -1) break;
+        stalls = queued + PIPE_BUF > size ? stalls + 1 : 0;
+        if (stalls >= PIPE_STALLS && size < pipe_max()) {
+            fcntl(w->fd, F_SETPIPE_SZ, 2L * size < pipe_max() ? 2L * size : pipe_max());
+            stalls = 0;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// This function starts watching the pipe whose read end is fd
+static struct pipewatch *pipe_watch_start (int fd) {
+    struct pipewatch *w = calloc(1, sizeof(struct pipewatch));
+
+    pipe_max();
+    if ((w->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+        free(w);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, pipe_watch, w)) {
+        close(w->fd);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static void pipe_watch_stop (struct pipewatch *w) {
+    if (!w) return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    close(w->fd);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w);
+}
+
+// The instrumented pipelines ("set -o pipestats"): each pipe goes through
+// a relay process moving the data on with splice(2), which counts the bytes
+// and the time it waited for the command before the pipe to write and for
+// the one after it to read.  The counts are kept in memory shared with the
+// relays, so that they are up to date while the pipeline runs, and a table
+// of the stages is printed once it has finished.
+#define STATS_STAGES 64
+#define STATS_NAME 32
+#define RELAY_BLOCK (1 << 20)
+
+struct stage {
+    char name[STATS_NAME];
+    long long start, end;       // in ns, end is 0 while the stage runs
+    int piped;                  // its output goes through a relay
+    unsigned long long bytes;   // written by the stage
+    long long starved;          // the relay waiting for the stage to write
+    long long blocked;          // the relay waiting for the next one to read
+};
+
+struct pipestats {
+    int n;
+    struct stage stage[STATS_STAGES];
+};
+
+// the statistics of the pipeline being run, the ones of the pipeline the
+// process is a stage of, and the ones of the last pipeline run
+static struct pipestats *stats, *stats_outer, *stats_last;
+
+static long long now_ns (void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// This function adds the stage cmd to the statistics; returns NULL when
+// the table is full
+static struct stage *stage_add (struct cmd *cmd) {
+    struct stage *s;
+    struct cmd *first;
+    int i;
+    size_t len = 0;
+
+    if (stats->n == STATS_STAGES) return NULL;
+    s = &stats->stage[stats->n++];
+    memset(s, 0, sizeof(struct stage));
+    // a compound stage is named after the first command in it
+    for (first = cmd; first->type != C_PLAIN && first->type != C_TEST && first->left; first = first->left);
+    for (i = 0; first->args && first->args[i] && len < STATS_NAME - 1; i++) {
+        len += snprintf(s->name + len, STATS_NAME - len, "%s%s", i ? " " : "", first->args[i]);
+    }
+    if (first != cmd && len < STATS_NAME - 1) snprintf(s->name + len, STATS_NAME - len, "%s...", len ? " " : "");
+    s->start = now_ns();
+    return s;
+}
+
+// wait until fd is ready for events, adding the time taken to *total
+static void relay_wait (int fd, short events, long long *total) {
+    struct pollfd p = { fd, events, 0 };
+    long long t = now_ns();
+
+    while (poll(&p, 1, -1) == -1 && errno == EINTR);
+    *total += now_ns() - t;
+}
+
+// the relay: move the standard input to the standard output, both pipes,
+// counting in s
+static void relay (struct stage *s) {
+    struct pollfd p = { 0, POLLIN, 0 };
+    ssize_t n;
+
+    signal(SIGPIPE, SIG_IGN);
+    for (;;) {
+        n = splice(0, NULL, 1, NULL, RELAY_BLOCK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            s->bytes += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno == EAGAIN) {
+            // either the input is empty or the output is full
+            if (poll(&p, 1, 0) == 0) relay_wait(0, POLLIN, &s->starved);
+            else relay_wait(1, POLLOUT, &s->blocked);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    s->end = now_ns();
+}
+
+// This function puts a relay counting in s after the write end of the pipe
+// fds; fds[0] becomes the read end of the pipe after it.  Returns the pid
+// of the relay, or -1 if it could not be started.
+static pid_t relay_start (int *fds, struct stage *s, long size) {
+    int out[2];
+    pid_t pid;
+
+    if (pipe(out) == -1) return -1;
+    if (size) fcntl(out[1], F_SETPIPE_SZ, size);
+    if ((pid = fork()) == -1) {
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    if (!pid) {
+        if (dup2(fds[0], 0) == -1 || dup2(out[1], 1) == -1) _exit(1);
+        close_range(3, ~0U, 0);
+        relay(s);
+        _exit(0);
+    }
+    s->piped = 1;
+    close(fds[0]);
+    close(out[1]);
+    fds[0] = out[0];
+    return pid;
+}
+
+// print n bytes in a short form
+static void stats_bytes (unsigned long long n) {
+    if (n < 10000) fprintf(stderr, " %9llu", n);
+    else if (n < 10000ULL << 10) fprintf(stderr, " %8lluK", n >> 10);
+    else if (n < 10000ULL << 20) fprintf(stderr, " %8lluM", n >> 20);
+    else fprintf(stderr, " %8lluG", n >> 30);
+}
+
+// This function prints the table of the stages of p, as it stands: the time
+// each one ran, the bytes it wrote and at what rate, the time it waited for
+// its input and for the next stage to take its output, and the time left,
+// spent working.  The stage working the longest is marked as the bottleneck.
+static void stats_show (struct pipestats *p) {
+    long long t = now_ns(), busy[STATS_STAGES], in, out, run;
+    int i, slow = 0;
+
+    fprintf(stderr, "  %-*s %9s %10s %9s %9s %9s %9s\n", STATS_NAME - 1, "stage", "time", "bytes", "MB/s", "wait in", "wait out", "busy");
+    for (i = 0; i < p->n; i++) {
+        struct stage *s = &p->stage[i];
+
+        run = (s->end ? s->end : t) - s->start;
+        in = i && p->stage[i-1].piped ? p->stage[i-1].starved : 0;
+        out = s->piped ? s->blocked : 0;
+        busy[i] = run - in - out > 0 ? run - in - out : 0;
+        if (busy[i] > busy[slow]) slow = i;
+    }
+    for (i = 0; i < p->n; i++) {
+        struct stage *s = &p->stage[i];
+
+        run = (s->end ? s->end : t) - s->start;
+        in = i && p->stage[i-1].piped ? p->stage[i-1].starved : 0;
+        out = s->piped ? s->blocked : 0;
+        fprintf(stderr, "%c %-*s %9.3f", i == slow && p->n > 1 ? '*' : ' ', STATS_NAME - 1, s->name, run / 1e9);
+        if (s->piped) {
+            stats_bytes(s->bytes);
+            fprintf(stderr, " %9.1f", run > 0 ? s->bytes / 1e6 / (run / 1e9) : 0.0);
+        } else {
+            fprintf(stderr, " %10s %9s", "-", "-");
+        }
+        fprintf(stderr, " %9.3f %9.3f %9.3f\n", in / 1e9, out / 1e9, busy[i] / 1e9);
+    }
+}
+
+// builtin "pipestats" (print the table of the pipeline it is a stage of, as
+// it stands, else of the last instrumented pipeline)
+int builtin_pipestats (char **args) {
+    struct pipestats *p = stats ? stats : stats_outer ? stats_outer : stats_last;
+
+    fflush(stdout);
+    if (!p) {
+        fprintf(stderr, "error: pipestats: no instrumented pipeline has run\n");
+        return 1;
+    }
+    stats_show(p);
+    return 0;
+}
+
+// a command of a merge, with the pipe of its output
+struct producer {
+    pid_t pid;
+    int fd;             // -1 once its output has ended
+    struct buf out;     // output not written yet
+};
+
+// This function writes the output kept for p, or with whole set only its
+// complete lines
+static void producer_flush (struct producer *p, int whole) {
+    size_t n = p->out.len;
+
+    if (!whole) {
+        while (n && p->out.s[n - 1] != '\n') n--;
+    }
+    if (!n) return;
+    bi_write(p->out.s, n);
+    memmove(p->out.s, p->out.s + n, p->out.len -= n);
+}
+
+// This function runs the commands of a chain of C_MERGE (a &| b &| c) or
+// C_CONCAT (a &; b &; c) nodes at the same time, each in a child with its
+// output on a pipe, read by an event loop.  The outputs of a merge are
+// written as they come, a whole line at a time so that lines are never
+// mixed; those of a concatenation one after the other, the output of a
+// command being kept until the ones before it have ended
+static int merge (struct cmd *cmd) {
+    struct producer *p;
+    struct pollfd *polls;
+    struct cmd *c;
+    char block[65536];
+    int n = 1, i, j, live, cur = 0, retval = 0, statval;
+    ssize_t len;
+
+    for (c = cmd; c->type == cmd->type; c = c->right) n++;
+    p = calloc(n, sizeof(struct producer));
+    polls = malloc(n * sizeof(struct pollfd));
+
+    fflush(stdout);
+    for (i = 0, c = cmd; i < n; i++, c = c->type == cmd->type ? c->right : NULL) {
+        int fds[2];
+
+        if (pipe(fds) == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            p[i].fd = -1;
+            p[i].pid = -1;
+            continue;
+        }
+        if ((p[i].pid = fork()) == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            close(fds[0]);
+            close(fds[1]);
+            p[i].fd = -1;
+            continue;
+        }
+        if (!p[i].pid) {
+            // child - runs its command with the output on the pipe
+            if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
+                fprintf(stderr, "error: %s\n", strerror(errno));
+                exit(-1);
+            }
+            capture = NULL;
+            for (j = 0; j < i; j++) {
+                if (p[j].fd != -1) close(p[j].fd);
+            }
+            if (dup2(fds[1], 1) == -1) {
+                fprintf(stderr, "error: %s\n", strerror(errno));
+                exit(-1);
+            }
+            close(fds[0]);
+            close(fds[1]);
+            exec_tail = 1;
+            exit(executeAux(c->type == cmd->type ? c->left : c));
+        }
+        close(fds[1]);
+        p[i].fd = fds[0];
+    }
+
+    for (;;) {
+        for (i = 0, live = 0; i < n; i++) {
+            if (p[i].fd == -1) continue;
+            polls[live].fd = p[i].fd;
+            polls[live++].events = POLLIN;
+        }
+        if (!live) break;
+        if (poll(polls, live, -1) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            retval = -1;
+            break;
+        }
+        for (i = 0, j = 0; i < n; i++) {
+            if (p[i].fd == -1) continue;
+            if (!polls[j++].revents) continue;
+            if ((len = read(p[i].fd, block, sizeof(block))) == -1 && errno == EINTR) continue;
+            if (len <= 0) {
+                // the end of the output, possibly with an unfinished line
+                close(p[i].fd);
+                p[i].fd = -1;
+                if (cmd->type == C_MERGE) producer_flush(&p[i], 1);
+            } else if (cmd->type == C_CONCAT && i == cur) {
+                bi_write(block, len);
+            } else {
+                buf_add(&p[i].out, block, len);
+                if (cmd->type == C_MERGE) producer_flush(&p[i], 0);
+            }
+        }
+        // the turn of a concatenated output comes when the ones before end
+        while (cmd->type == C_CONCAT && cur < n) {
+            producer_flush(&p[cur], 1);
+            if (p[cur].fd != -1) break;
+            cur++;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (p[i].fd != -1) close(p[i].fd);
+        free(p[i].out.s);
+        if (p[i].pid == -1) {
+            retval = -1;
+        } else if (waitpid(p[i].pid, &statval, 0) == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            retval = -1;
+        } else if (WIFEXITED(statval)) {
+            retval = retval || WEXITSTATUS(statval);
+        } else if (!WIFSIGNALED(statval) || WTERMSIG(statval) != SIGPIPE) {
+            retval = retval || WTERMSIG(statval);
+        }
+    }
+    free(polls);
+    free(p);
+    return retval;
+}
+
+// the ends kept by the shell of the pipes of the running process
+// substitutions, and the processes at their other ends
+static struct {
+    int fd;
+    pid_t pid;
+} *procs;
+static int nprocs, procscap;
+
+// This function starts a process substitution: cmd runs concurrently with
+// its output (or for >(cmd), its input) on a pipe, whose other end is
+// returned to be passed as /dev/fd/N to the command being expanded
+int procsub (struct cmd *cmd, int output) {
+    int fds[2], i;
+    pid_t pid;
+
+    if (pipe(fds) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+    fflush(stdout);
+    if ((pid = fork()) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (!pid) {
+        // child - runs the command on its end of the pipe
+        if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            exit(-1);
+        }
+        capture = NULL;
+        // the pipes of the other substitutions would keep them from ending
+        for (i = 0; i < nprocs; i++) close(procs[i].fd);
+        if (dup2(fds[!output], !output) == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            exit(-1);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        exec_tail = 1;
+        exit(execute(cmd));
+    }
+
+    close(fds[!output]);
+    if (nprocs == procscap) {
+        procscap = procscap ? 2 * procscap : 8;
+        procs = realloc(procs, procscap * sizeof(*procs));
+    }
+    procs[nprocs].fd = fds[output];
+    procs[nprocs].pid = pid;
+    return procs[nprocs++].fd;
+}
+
+// close the process substitutions started since mark and reap their
+// processes; a producer whose output was not all read ends on SIGPIPE
+static void procsub_done (int mark) {
+    while (nprocs > mark) {
+        nprocs--;
+        close(procs[nprocs].fd);
+        waitpid(procs[nprocs].pid, NULL, 0);
+    }
+}
+
+// This function returns the index of the first item of a case command with
+// a pattern matching word, or -1.  The patterns compiled by the parser are
+// matched at once; those expanded now only need to be tried for the items
+// before the one found that way
+static int case_select (struct cases *c, char *word) {
+    size_t n = strlen(word);
+    int found = patset_match(c->set, word, n), i, j;
+
+    for (i = 0; i < c->n && (found < 0 || i < found); i++) {
+        for (j = 0; c->arm[i].dynamic[j]; j++) {
+            struct pattern *p = expand_pattern(c->arm[i].dynamic[j]);
+
+            if (p && pat_match(p, word, n)) return i;
+        }
+    }
+    return found;
+}
+
+// set when the command about to run is the last thing the process does:
+// an external command then replaces the process instead of running in a
+// child (tail-exec)
+int exec_tail;
+
+// the plain command whose builtin is running, and the number of times the
+// redirections of an exec builtin were kept in place for the shell
+static struct cmd *running;
+static int kept;
+
+// This function replaces the process with the external program of args,
+// the prefix assignments assigns going to its environment; it only returns
+// on failure
+static int exec_program (char **args, char **assigns) {
+    char **envp = var_environ(), **oldenv = environ;
+    void (*saved)(int);
+
+    // the prefix assignments only go to the command's environment
+    if (assigns && !(envp = overlay(assigns))) return -1;
+
+    // restore SIGINT's default action
+    fflush(stdout);
+    if ((saved = signal(SIGINT, SIG_DFL)) == SIG_ERR) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // execute the command, its PATH being looked up in its environment
+    environ = envp;
+    execvp(args[0], args);
+
+    // if we get to this line, the command has failed; the environment
+    // given to it is not the shell's, which the snapshot may replace
+    fprintf(stderr, "error: %s\n", strerror(errno));
+    environ = oldenv;
+    if (assigns) var_overlay_free(envp);
+    signal(SIGINT, saved);
+    return -1;
+}
+
+// builtin "exec" (replace the shell with the command given, or without one,
+// keep the redirections for the commands that follow)
+int builtin_exec (char **args) {
+    // the threads of compressed redirections do not survive it
+    if (nzips) {
+        fprintf(stderr, "error: exec: compressed redirections are open\n");
+        return -1;
+    }
+    if (!args[1]) {
+        kept++;
+        return 0;
+    }
+    return exec_program(args + 1, running ? running->assigns : NULL);
+}
+
+// size of the pieces of input given to the copies of a replicated stage
+#define REPLICATE_CHUNK (1 << 20)
+
+// a run of the command of a replicated stage on a piece of the input
+struct replica {
+    pid_t pid;
+    int fd;             // the pipe of its output, -1 once it has ended
+    struct buf out;     // output kept until the runs before it have ended
+};
+
+// This function starts a run of the replicated command args on s[0..n),
+// given as a file in memory so that the shell never waits on its input
+static int replica_start (struct replica *r, char **args, char *s, size_t n, struct replica *all, int count) {
+    int in = memfd_create("replicate", MFD_CLOEXEC), fds[2], i;
+
+    if (in == -1 || (n && write(in, s, n) != (ssize_t) n) || lseek(in, 0, SEEK_SET) == -1 || pipe(fds) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        if (in != -1) close(in);
+        return -1;
+    }
+    fflush(stdout);
+    if ((r->pid = fork()) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        close(in);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (!r->pid) {
+        // child - its input is the piece, its output the pipe
+        for (i = 0; i < count; i++) {
+            if (all[i].fd != -1) close(all[i].fd);
+        }
+        if (dup2(in, 0) == -1 || dup2(fds[1], 1) == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            exit(-1);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        exit(exec_program(args, running ? running->assigns : NULL));
+    }
+    close(in);
+    close(fds[1]);
+    r->fd = fds[0];
+    r->out.len = 0;
+    return 0;
+}
+
+// builtin "replicate" (run a stage of a pipeline as several copies of the
+// command given: the input is cut into pieces of whole lines, of about
+// -s bytes, each given to a new run of the command, with at most -n of
+// them at once, one per processor by default; their outputs are written in
+// the order of the pieces)
+int builtin_replicate (char **args) {
+    struct replica *r;
+    struct pollfd *polls;
+    struct buf in;
+    char block[65536];
+    long n = sysconf(_SC_NPROCESSORS_ONLN), size = REPLICATE_CHUNK;
+    int i, j, head = 0, count = 0, eof = 0, retval = 0, statval;
+    ssize_t len;
+
+    for (i = 1; args[i] && args[i][0] == '-'; i++) {
+        if (!strcmp(args[i], "--")) {
+            i++;
+            break;
+        } else if (!strcmp(args[i], "-n") && args[i+1]) {
+            n = atol(args[++i]);
+        } else if (!strcmp(args[i], "-s") && args[i+1]) {
+            size = atol(args[++i]);
+        } else {
+            break;
+        }
+    }
+    if (!args[i] || n < 1 || size < 1) {
+        fprintf(stderr, "error: replicate: usage: replicate [-n copies] [-s bytes] command [argument ...]\n");
+        return -1;
+    }
+    args += i;
+
+    r = calloc(n, sizeof(struct replica));
+    polls = malloc(n * sizeof(struct pollfd));
+    memset(&in, 0, sizeof(struct buf));
+    for (i = 0; i < n; i++) r[i].fd = -1;
+
+    while (!eof || count) {
+        // a new run for each piece, while there is room
+        while (!eof && count < n && retval != -1) {
+            char *cut = NULL;
+
+            while (!eof && (in.len < (size_t) size || !(cut = memrchr(in.s, '\n', in.len)))) {
+                if ((len = read(0, block, sizeof(block))) == -1 && errno == EINTR && !bi_interrupted) continue;
+                if (len <= 0 || bi_interrupted) eof = 1;
+                else buf_add(&in, block, len);
+            }
+            // after SIGINT, no new run starts; the ones running get it too
+            if (bi_interrupted) in.len = 0;
+            if (eof) cut = in.len ? in.s + in.len - 1 : NULL;
+            if (!cut) break;
+
+            i = (head + count) % n;
+            if (replica_start(&r[i], args, in.s, cut + 1 - in.s, r, n) == -1) {
+                retval = -1;
+                break;
+            }
+            count++;
+            memmove(in.s, cut + 1, in.len -= cut + 1 - in.s);
+        }
+        if (!count) break;
+
+        // the outputs: the one of the oldest run goes straight through
+        for (i = 0, j = 0; i < count; i++) {
+            if (r[(head + i) % n].fd == -1) continue;
+            polls[j].fd = r[(head + i) % n].fd;
+            polls[j++].events = POLLIN;
+        }
+        if (j && poll(polls, j, -1) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            retval = -1;
+            break;
+        }
+        for (i = 0, j = 0; i < count; i++) {
+            struct replica *p = &r[(head + i) % n];
+
+            if (p->fd == -1 || !polls[j++].revents) continue;
+            if ((len = read(p->fd, block, sizeof(block))) == -1 && errno == EINTR) continue;
+            if (len <= 0) {
+                close(p->fd);
+                p->fd = -1;
+            } else if (i == 0) {
+                bi_write(block, len);
+            } else {
+                buf_add(&p->out, block, len);
+            }
+        }
+
+        // the runs are finished in order
+        while (count && r[head].fd == -1) {
+            int w;
+
+            while ((w = waitpid(r[head].pid, &statval, 0)) == -1 && errno == EINTR);
+            if (w == -1) {
+                fprintf(stderr, "error: %s\n", strerror(errno));
+                retval = -1;
+            } else if (WIFEXITED(statval)) {
+                retval = retval || WEXITSTATUS(statval);
+            } else {
+                retval = retval || WTERMSIG(statval);
+            }
+            head = (head + 1) % n;
+            count--;
+            if (count && r[head].out.len) {
+                bi_write(r[head].out.s, r[head].out.len);
+                r[head].out.len = 0;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++) free(r[i].out.s);
+    free(r);
+    free(polls);
+    free(in.s);
+    return bi_interrupted ? -1 : retval;
+}
+
+// The pipelines of builtins: adjacent stages that are builtins reading and
+// writing through bi_read and bi_write run as threads of a single process,
+// joined by ring buffers rather than pipes (see ring.c).  The last of them
+// runs in the calling thread; the stages before it are started as threads.
+#define STAGE_RING (1 << 16)
+
+struct stagethread {
+    pthread_t thread;
+    builtin_fn *builtin;
+    char **args;
+    struct stageio io;
+    int retval;
+};
+
+static void *stage_main (void *arg) {
+    struct stagethread *t = arg;
+
+    bi_io = &t->io;
+    t->retval = t->builtin(t->args);
+    // the previous stage stops writing, the next one gets the end
+    if (t->io.in) ring_close_read(t->io.in);
+    ring_close_write(t->io.out);
+    return NULL;
+}
+
+// whether cmd may be a stage of a pipeline of builtins, the last one if
+// last is set: a builtin run as a thread gets no redirections nor prefix
+// assignments, the last one none of its input
+static int stage_ok (struct cmd *cmd, int last) {
+    if (cmd->type != C_PLAIN || !cmd->args[0] || !builtin_stage(cmd->args)) return 0;
+    if (cmd->input || cmd->here) return 0;
+    return last || (!cmd->assigns && !cmd->output && !cmd->append && !cmd->error);
+}
+
+// This function returns the number of builtins starting the pipeline cmd
+// that may run as threads, and sets *rest to the rest of the pipeline, NULL
+// if there is none
+static int stage_count (struct cmd *cmd, struct cmd **rest) {
+    int n = 0;
+
+    for (; cmd->type == C_PIPE && stage_ok(cmd->left, 0); cmd = cmd->right) n++;
+    if (cmd->type != C_PIPE && stage_ok(cmd, 1)) {
+        *rest = NULL;
+        return n + 1;
+    }
+    *rest = cmd;
+    return n;
+}
+
+// This function runs the n builtins starting the pipeline cmd as a pipeline
+// of threads, with size bytes in each ring; returns the status of the last
+// one, or a failure of one of the others
+static int stage_pipeline (struct cmd *cmd, int n, long size) {
+    struct stagethread *t = calloc(n, sizeof(struct stagethread));
+    pthread_t *ids = malloc(n * sizeof(pthread_t));
+    struct stageio io;
+    int i, started, retval, rc;
+
+    // the arguments are expanded first: the threads keep off the variables
+    for (i = 0; i < n - 1; i++, cmd = cmd->right) {
+        t[i].builtin = builtin_stage(cmd->left->args);
+        if (!(t[i].args = expand_args(cmd->left->args, NULL))) break;
+        t[i].io.out = ring_new(size ? size : STAGE_RING);
+        t[i].io.outfd = -1;
+        if (i) t[i].io.in = t[i-1].io.out;
+    }
+    if (i < n - 1) {
+        while (i--) {
+            free_args(t[i].args);
+            ring_free(t[i].io.out);
+        }
+        free(ids);
+        free(t);
+        return -1;
+    }
+    // SIGINT stops them all, wherever it lands
+    bi_catch();
+    for (started = 0; started < n - 1; started++) {
+        if (!(rc = pthread_create(&t[started].thread, NULL, stage_main, &t[started]))) {
+            ids[started] = t[started].thread;
+            bi_catch_threads(ids, started + 1);
+        } else {
+            fprintf(stderr, "error: %s\n", strerror(rc));
+            // the last one started has no reader, and the ones after it
+            // no writer
+            if (started) ring_close_read(t[started-1].io.out);
+            for (i = started; i < n - 1; i++) ring_close_write(t[i].io.out);
+            break;
+        }
+    }
+
+    // the last one, whose input is the ring of the one before
+    memset(&io, 0, sizeof(struct stageio));
+    io.in = t[n-2].io.out;
+    io.outfd = -1;
+    bi_io = &io;
+    retval = started == n - 1 ? executeAux(cmd->type == C_PIPE ? cmd->left : cmd) : -1;
+    bi_io = NULL;
+    ring_close_read(io.in);
+
+    for (i = n - 2; i >= 0; i--) {
+        if (i < started) {
+            bi_catch_threads(ids, i + 1);
+            pthread_join(t[i].thread, NULL);
+        } else {
+            retval = -1;
+        }
+        // a stage whose reader went early is not failing
+        if (t[i].retval && !t[i].io.broken) retval = retval || t[i].retval;
+        free_args(t[i].args);
+    }
+    bi_catch_threads(NULL, 0);
+    bi_release();
+    for (i = 0; i < n - 1; i++) ring_free(t[i].io.out);
+    free(ids);
+    free(t);
+    return retval;
+}
+
+// A pipeline starting with "cat file ..." before other commands does not
+// fork for the cat: a thread of the shell feeds the files to the pipe with
+// sendfile(2).  The write end of the pipe it holds is closed in the children
+// forked meanwhile, so that only the thread keeps the pipe open.
+#define FEED_MAX 16
+
+static int feeding[FEED_MAX], nfeeding;
+static pthread_mutex_t feed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void feed_prepare (void) {
+    pthread_mutex_lock(&feed_lock);
+}
+
+static void feed_parent (void) {
+    pthread_mutex_unlock(&feed_lock);
+}
+
+static void feed_child (void) {
+    while (nfeeding) close(feeding[--nfeeding]);
+    pthread_mutex_unlock(&feed_lock);
+}
+
+// stop closing fd in the children, and close it
+static void feed_drop (int fd) {
+    int i;
+
+    pthread_mutex_lock(&feed_lock);
+    for (i = 0; feeding[i] != fd; i++);
+    feeding[i] = feeding[--nfeeding];
+    close(fd);
+    pthread_mutex_unlock(&feed_lock);
+}
+
+static void *feed_main (void *arg) {
+    struct stagethread *t = arg;
+    sigset_t set;
+
+    // a reader gone makes the writes fail with EPIPE: SIGPIPE would stop
+    // the shell
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    bi_io = &t->io;
+    t->retval = t->builtin(t->args);
+    feed_drop(t->io.outfd);
+    return NULL;
+}
+
+// This function starts feeding the pipe whose write end is fd with the cat
+// command cmd; returns NULL if the command reads its input, or if it cannot
+// be run by a thread
+static struct stagethread *feed_start (struct cmd *cmd, int fd) {
+    static int registered;
+    struct stagethread *t;
+    char **args;
+    int i;
+
+    if (strcmp(cmd->args[0], "cat") || nfeeding == FEED_MAX) return NULL;
+    if (!(args = expand_args(cmd->args, NULL))) return NULL;
+    for (i = 1; args[i] && strcmp(args[i], "-"); i++);
+    if (i == 1 || args[i] || !cat_takes(args)) {
+        free_args(args);
+        return NULL;
+    }
+    if (!registered++) pthread_atfork(feed_prepare, feed_parent, feed_child);
+
+    t = calloc(1, sizeof(struct stagethread));
+    t->builtin = builtin_cat;
+    t->args = args;
+    if ((t->io.outfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+        free_args(args);
+        free(t);
+        return NULL;
+    }
+    pthread_mutex_lock(&feed_lock);
+    feeding[nfeeding++] = t->io.outfd;
+    pthread_mutex_unlock(&feed_lock);
+    if (pthread_create(&t->thread, NULL, feed_main, t)) {
+        feed_drop(t->io.outfd);
+        free_args(args);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// This function waits for the feeding thread t; returns its status
+static int feed_finish (struct stagethread *t) {
+    int retval;
+
+    pthread_join(t->thread, NULL);
+    // a thread whose reader went early is not failing
+    retval = t->io.broken ? 0 : t->retval;
+    free_args(t->args);
+    free(t);
+    return retval;
+}
+
+// This function starts the external program of cmd with the arguments
+// args, its output going to the pipe outpipe if it is open; returns the
+// pid of the child
+static pid_t launch (struct cmd *cmd, char **args, int *outpipe) {
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid) return pid;
+
+    // child - execute the command
+    if (outpipe[1] != -1) {
+        if (dup2(outpipe[1], 1) == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            exit(-1);
+        }
+        close(outpipe[0]);
+        close(outpipe[1]);
+    }
+    exit(exec_program(args, cmd->assigns));
+}
+
+// This function waits for the child pid to terminate and returns its exit value
+static int reap (pid_t pid) {
+    int statval;
+
+    if (waitpid(pid, &statval, 0) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+    if (WIFEXITED(statval)) { // termination by call to exit
+        // return the child's exit value
+        return WEXITSTATUS(statval);
+    } else if (WIFSIGNALED(statval)) { // termination by signal
+        // return the signal's value
+        return WTERMSIG(statval);
+    }
+    fprintf(stderr, "error: child process did not terminate with exit or due to the receipt of a signal\n");
+    return -1;
+}
+
+// This function runs the external program of cmd with the arguments args,
+// whose output is read through a pipe if it is captured by a command
+// substitution
+static int run (struct cmd *cmd, char **args) {
+    int outpipe[2] = { -1, -1 };
+    pid_t pid;
+
+    if (capture && !cmd->output && !cmd->append && pipe(outpipe) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+    pid = launch(cmd, args, outpipe);
+    if (outpipe[0] != -1) {
+        close(outpipe[1]);
+        if (pid != -1 && buf_read(capture, outpipe[0]) == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+        }
+        close(outpipe[0]);
+    }
+    return pid == -1 ? -1 : reap(pid);
+}
+
+// room taken by an argument in the memory of execve
+#define ARG_SIZE(s) (strlen(s) + 1 + sizeof(char*))
+
+// room left for arguments by the system's limit, kept a little below
+#define ARG_HEADROOM 2048
+
+// This function returns the room left by the arguments and environment
+// of the external program of cmd under the limit of execve, negative if
+// they don't fit
+static long args_room (struct cmd *cmd, char **args) {
+    long room = sysconf(_SC_ARG_MAX) - ARG_HEADROOM - var_envsize() - sizeof(char*);
+    int i;
+
+    for (i = 0; args[i]; i++) room -= ARG_SIZE(args[i]);
+    for (i = 0; cmd->assigns && cmd->assigns[i]; i++) room -= ARG_SIZE(cmd->assigns[i]);
+    return room;
+}
+
+// This function runs the external program of cmd with an argument list too
+// long for execve as several commands, like xargs: the fields of the word
+// that expanded to the most bytes (ends[i] being the end of the fields of
+// the i-th word) are split into batches, each run with the fields of the
+// other words around it.  Up to $BATCH_JOBS batches run at the same time,
+// unless their output is captured; the status is the last failing one
+static int run_batches (struct cmd *cmd, char **args, int *ends) {
+    long room = args_room(cmd, args), size, bytes;
+    int nargs, w, best = -1, lo, hi, i, j, k, njobs, running = 0, retval = 0, status;
+    char **batch, *jobs = var_get("BATCH_JOBS");
+    pid_t *pids, pid;
+
+    for (nargs = 0; args[nargs]; nargs++);
+    // the word to split, which isn't the command name
+    for (w = 0, size = 0; cmd->args[w]; w++) {
+        int start = w ? ends[w - 1] : 0;
+        long wsize = 0;
+
+        if (!start) continue;
+        for (i = start; i < ends[w]; i++) wsize += ARG_SIZE(args[i]);
+        if (best < 0 || wsize > size) {
+            best = w;
+            size = wsize;
+        }
     }
-    if (setenv("PWD", cwd, 1)) {
-        fprintf(stderr, "error: %s\n", strerror(errno));
-        fprintf(stderr, "cannot create $?\n");
-        exit (-1);
+    if (best < 0) {
+        fprintf(stderr, "error: argument list too long\n");
+        return -1;
+    }
+    lo = ends[best - 1];
+    hi = ends[best];
+    // the room of a batch is what the other fields leave
+    room += size;
+    for (i = lo; i < hi; i++) {
+        if ((long) ARG_SIZE(args[i]) > room) {
+            fprintf(stderr, "error: argument list too long\n");
+            return -1;
+        }
     }
 
-    // "?" variable to store the last command's exit value
-    if (setenv("?", "0", 1)) {
-        fprintf(stderr, "error: %s\n", strerror(errno));
-        fprintf(stderr, "cannot create $?\n");
-        exit (-1);
+    njobs = jobs && atoi(jobs) > 0 ? atoi(jobs) : 1;
+    if (capture && !cmd->output && !cmd->append) njobs = 1;
+    pids = malloc(njobs * sizeof(pid_t));
+    batch = malloc((nargs + 1) * sizeof(char*));
+    memcpy(batch, args, lo * sizeof(char*));
+    for (i = lo; i < hi; i = j) {
+        int outpipe[2] = { -1, -1 };
+
+        for (j = i, bytes = 0; j < hi && bytes + (long) ARG_SIZE(args[j]) <= room; j++) {
+            bytes += ARG_SIZE(args[j]);
+        }
+        memcpy(batch + lo, args + i, (j - i) * sizeof(char*));
+        k = lo + j - i;
+        memcpy(batch + k, args + hi, (nargs - hi + 1) * sizeof(char*));
+
+        if (njobs == 1) {
+            status = run(cmd, batch);
+        } else {
+            // wait for the oldest batch if all the slots are taken
+            if (running == njobs) {
+                status = reap(pids[0]);
+                if (status) retval = status;
+                memmove(pids, pids + 1, --running * sizeof(pid_t));
+            }
+            if ((pid = launch(cmd, batch, outpipe)) == -1) {
+                status = -1;
+            } else {
+                pids[running++] = pid;
+                status = 0;
+            }
+        }
+        if (status) retval = status;
+    }
+    for (i = 0; i < running; i++) {
+        if ((status = reap(pids[i]))) retval = status;
     }
+    free(pids);
+    free(batch);
+    return retval;
+}
 
-    // Ignore SIGINT (CTRL-C)
-    if (signal(SIGINT, SIG_IGN) == SIG_ERR) {
-        fprintf(stderr, "error: %s\n", strerror(errno));
-        exit(-1);
+// The parallel sequences ("set -o parallel"): the plain commands of a chain
+// of ';' whose output goes to a file, and whose input is a file or a
+// here-document, run at the same time, up to $PARALLEL_JOBS of them, or as
+// many as there are processors.  A command waits for the earlier ones
+// reading a file it writes or writing a file it reads or writes, the files
+// being the ones named by the redirections.  The other commands, and those
+// which may do more than that (builtins changing the shell, command
+// substitutions, $?), wait for all the earlier ones and run in the shell as
+// usual.
+
+// a file of a command of a parallel sequence
+struct seqfile {
+    char *path;         // its real path
+    int write;
+};
+
+// a command of a parallel sequence, running
+struct seqjob {
+    pid_t pid;
+    struct seqfile *file;
+    int n;
+};
+
+// the real path of the file word, which may not exist yet, or NULL if its
+// expansion failed
+static char *seq_path (char *word) {
+    char *path = expand_word(word), *real, *slash, *dir, *s;
+
+    if (!path) return NULL;
+    if ((real = realpath(path, NULL))) {
+        free(path);
+        return real;
     }
+    // a file to be created: the real path of its directory, and its name
+    slash = strrchr(path, '/');
+    dir = slash ? strndup(path, slash - path + (slash == path)) : strdup(".");
+    if (!(real = realpath(dir, NULL))) {
+        free(dir);
+        return path;
+    }
+    s = malloc(strlen(real) + strlen(slash ? slash : path) + 2);
+    sprintf(s, "%s/%s", strcmp(real, "/") ? real : "", slash ? slash + 1 : path);
+    free(real);
+    free(dir);
+    free(path);
+    return s;
+}
 
+static void seq_add (struct seqjob *job, char *word, int write) {
+    job->file = realloc(job->file, (job->n + 1) * sizeof(struct seqfile));
+    job->file[job->n].path = seq_path(word);
+    job->file[job->n++].write = write;
+}
 
-    while (1) {
-        int exitval;
-        char exitstr[MAXDIGIT_INT];
+static void seq_free (struct seqjob *job) {
+    while (job->n) free(job->file[--job->n].path);
+    free(job->file);
+}
 
-        char *line = readline ("shell> ");
-        if (!line) break;	// user pressed CTRL+D; quit shell
-        if (!*line) continue;	// empty line
+// whether the word may do more than give a name
+static int seq_unsafe (char *word) {
+    return word && (strstr(word, "$(") || strchr(word, '`') || strstr(word, "<(") || strstr(word, ">(") || strstr(word, "$?"));
+}
 
-        add_history (line);	// add line to history
+// This function fills job with the files of cmd; returns -1 if cmd must
+// wait for all the earlier commands and run in the shell
+static int seq_files (struct cmd *cmd, struct seqjob *job) {
+    int i;
 
-        struct cmd *cmd = parser(line);
-        if (!cmd) continue;	// some parse error occurred; ignore
-        
-        exitval = execute(cmd);
-        if (exitval == SIGINT) {
-            // print a newline if the program terminated with SIGINT
-            printf("\n");
-        }
+    memset(job, 0, sizeof(struct seqjob));
+    if (cmd->type != C_PLAIN || !cmd->args[0] || (!cmd->output && !cmd->append)) return -1;
+    // the shell's input is read in order
+    if (!cmd->input && !cmd->here) return -1;
+    // a builtin other than the ones only writing their output changes the
+    // shell; a quoted or expanded name could be one
+    if (strpbrk(cmd->args[0], "'\"\\$`{*?[~") || (builtin_lookup(cmd->args) && !builtin_stage(cmd->args))) {
+        return -1;
+    }
+    for (i = 0; cmd->args[i]; i++) if (seq_unsafe(cmd->args[i])) return -1;
+    for (i = 0; cmd->assigns && cmd->assigns[i]; i++) if (seq_unsafe(cmd->assigns[i])) return -1;
+    if (seq_unsafe(cmd->input) || seq_unsafe(cmd->output) || seq_unsafe(cmd->append) || seq_unsafe(cmd->error) || seq_unsafe(cmd->here)) {
+        return -1;
+    }
 
-        // maintain the "?" variable
-        sprintf(exitstr, "%d", exitval);
-        if (setenv("?", exitstr, 1)) {
-            fprintf(stderr, "error: %s\n", strerror(errno));
-            fprintf(stderr, "cannot update $?\n");
-            exit (-1);
+    if (cmd->input) seq_add(job, cmd->input, 0);
+    if (cmd->output) seq_add(job, cmd->output, 1);
+    if (cmd->append) seq_add(job, cmd->append, 1);
+    if (cmd->error) seq_add(job, cmd->error, 1);
+    for (i = 0; i < job->n; i++) {
+        if (!job->file[i].path) {
+            seq_free(job);
+            return -1;
         }
     }
+    return 0;
+}
 
-    printf("goodbye!\n");
+// whether one of the commands a and b writes a file of the other
+static int seq_conflict (struct seqjob *a, struct seqjob *b) {
+    int i, j;
+
+    for (i = 0; i < a->n; i++) {
+        for (j = 0; j < b->n; j++) {
+            if ((a->file[i].write || b->file[j].write) && !strcmp(a->file[i].path, b->file[j].path)) return 1;
+        }
+    }
     return 0;
 }
 
-int execute (struct cmd *cmd) {
-    propagate(cmd);
-    return executeAux(cmd);
+// This function runs the chain of C_SEQ cmd, whose last command ends the
+// process if tail is set; returns the status of the last command
+static int seq_parallel (struct cmd *cmd, int tail) {
+    struct seqjob *jobs = NULL, job;
+    char *slots;
+    int njobs = 0, max, i, status, retval = 0;
+    pid_t prev = 0, pid;
+
+    for (;;) {
+        struct cmd *c = cmd->type == C_SEQ ? cmd->left : cmd;
+        int barrier = seq_files(c, &job) == -1;
+
+        // the number of slots may be set by the commands run so far
+        slots = var_get("PARALLEL_JOBS");
+        max = slots && atoi(slots) > 0 ? atoi(slots) : sysconf(_SC_NPROCESSORS_ONLN);
+        if (max < 1) max = 1;
+        jobs = realloc(jobs, (njobs + 1) * sizeof(struct seqjob));
+
+        // wait for the commands that c must follow, or for a free slot;
+        // the status of the previous command is the one $? gets
+        for (i = 0; i < njobs; ) {
+            if (!barrier && njobs < max && !seq_conflict(&jobs[i], &job)) {
+                i++;
+                continue;
+            }
+            status = reap(jobs[i].pid);
+            if (jobs[i].pid == prev) retval = laststatus = status;
+            seq_free(&jobs[i]);
+            memmove(jobs + i, jobs + i + 1, (--njobs - i) * sizeof(struct seqjob));
+        }
+
+        fflush(stdout);
+        if (barrier || (pid = fork()) == -1) {
+            if (!barrier) seq_free(&job);
+            if (cmd->type != C_SEQ) exec_tail = tail;
+            retval = executeAux(c);
+            prev = 0;
+        } else if (!pid) {
+            // child - the command is the last thing it does
+            exec_tail = 1;
+            exit(executeAux(c));
+        } else {
+            job.pid = prev = pid;
+            jobs[njobs++] = job;
+        }
+        if (cmd->type != C_SEQ) break;
+        cmd = cmd->right;
+    }
+
+    while (njobs) {
+        status = reap(jobs[--njobs].pid);
+        if (jobs[njobs].pid == prev) retval = status;
+        seq_free(&jobs[njobs]);
+    }
+    free(jobs);
+    return retval;
 }
 
 int executeAux (struct cmd *cmd) {
     int retval; // return value of execute
+    int procmark = nprocs; // process substitutions started before this command
+    int zipmark = nzips; // compressed redirections started before this command
+    int tail = exec_tail; // whether the process ends with this command
+    int keptmark = kept; // exec builtins run before this command
     int in, out, err; // used to restore the process's stdin, stdout, stderr at the end of the execution
+    struct pipestats *shown = NULL; // the statistics of the pipeline, printed at the end
 
     in = dup(0);
     if (in == -1) {
@@ -111,164 +1428,130 @@ int executeAux (struct cmd *cmd) {
         exit(-1);
     }
 
+    // only the last of the subcommands is at the end of the process
+    exec_tail = 0;
+
     switch (cmd->type) {
-        case C_PLAIN:
-        // builtin "cd" command (change directory)
-        if (strcmp(cmd->args[0], "cd") == 0) {
-            // builtin "cd" (change directory)
-            char cwd[MAXPATHLEN + 1];
+        case C_PLAIN: {
+            char **args;
+            int *ends, n;
+            long room;
+            builtin_fn *builtin;
 
-            if (chdir(cmd->args[1]) == -1) {
-                fprintf(stderr, "error: %s\n", strerror(errno));
+            // the fields of each word are told apart for run_batches
+            for (n = 0; cmd->args[n]; n++);
+            ends = malloc((n + 1) * sizeof(int));
+            args = expand_args(cmd->args, ends);
+            if (!args) {
+                free(ends);
                 retval = -1;
                 break;
             }
 
-            if (getcwd(cwd, MAXPATHLEN) == NULL) {
-                fprintf(stderr, "error: %s\n", strerror(errno));
+            // handle the redirections (not mixing our pending output in)
+            fflush(stdout);
+            if (redirect(cmd) == -1) {
+                free_args(args);
+                free(ends);
                 retval = -1;
                 break;
             }
 
-            if (setenv("PWD", cwd, 1)) {
-                fprintf(stderr, "error: %s\n", strerror(errno));
-                fprintf(stderr, "cannot create $?\n");
-                retval = -1;
+            // plain variable assignments
+            if (!args[0]) {
+                int subs = cmdsubs;
+
+                retval = assign(cmd->assigns, 0);
+                // the status is the one of the last command substitution
+                if (!retval && cmdsubs != subs) retval = laststatus;
+                free_args(args);
+                free(ends);
                 break;
             }
 
-            retval = 0; 
-            break;
-        }
-
-        // external program
-        if (fork()) {
-            // father - wait for child to terminate
-            int statval;
+            // builtin command
+            if ((builtin = builtin_lookup(args))) {
+                struct buf *saved = capture;
 
-            if (wait(&statval) == -1) 
-            {
-                fprintf(stderr, "error: %s\n", strerror(errno));   
-                retval = -1;
+                // a redirected output is not captured by a substitution
+                if (cmd->output || cmd->append) capture = NULL;
+                // like the special builtins, they keep the prefix assignments
+                retval = assign(cmd->assigns, 0);
+                running = cmd;
+                if (!retval && builtin_sigint(builtin)) {
+                    bi_catch();
+                    retval = builtin(args);
+                    bi_release();
+                } else if (!retval) {
+                    retval = builtin(args);
+                }
+                running = NULL;
+                capture = saved;
+                free_args(args);
+                free(ends);
                 break;
             }
 
-            if (WIFEXITED(statval)) { // termination by call to exit
-                // return the child's exit value
-                retval = WEXITSTATUS(statval);
-                break;
-            } else if (WIFSIGNALED(statval)) { // termination by signal
-                // return the signal's value
-                retval = WTERMSIG(statval);
-                break;
-            } else {
-                fprintf(stderr, "error: child process did not terminate with exit or due to the receipt of a signal\n");
+            // external program; an argument list too long for execve is
+            // refused before forking, or run in batches with "set -o batch"
+            if ((room = args_room(cmd, args)) < 0 && !opt_batch) {
+                fprintf(stderr, "error: argument list too long\n");
                 retval = -1;
-                break;
-            }
-        } else {	
-            // child - execute the command
-            mode_t mask, filemode;
-
-            // restore SIGINT's default action
-            if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
-                fprintf(stderr, "error: %s\n", strerror(errno));
-                exit(-1);
-            }
-
-            // handle the redirections
-
-            // get the current umask value
-            mask = umask(0);
-            umask (mask);
-            // compute the actual file permission mode
-            filemode = (0666) ^ mask;
-
-            if (cmd->input) {
-                int input = open(cmd->input, O_RDONLY);
-
-                if (input == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
-                if (dup2(input, 0) == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
-                if (close(input) == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
+            } else if (room < 0) {
+                retval = run_batches(cmd, args, ends);
+            } else if (tail && !capture && nprocs == procmark && nzips == zipmark) {
+                retval = exec_program(args, cmd->assigns);
+            } else {
+                retval = run(cmd, args);
             }
+            free_args(args);
+            free(ends);
+            break;
+        }
 
-            if (cmd->output) {
-                int output = open(cmd->output, O_WRONLY| O_TRUNC | O_CREAT, filemode);
+        case C_VOID:
+        exec_tail = tail;
+        retval = executeAux(cmd->left);
+        break;
 
-                if (output == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
-                if (dup2(output, 1) == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
-                if (close(output) == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
+        case C_TEST:
+            fflush(stdout);
+            if (redirect(cmd) == -1) {
+                retval = -1;
+                break;
             }
+            retval = test_eval(cmd->args);
+            break;
 
-            if (cmd->append) {
-                int append = open(cmd->append, O_WRONLY | O_APPEND | O_CREAT, filemode);
+        case C_CASE: {
+            char *word = expand_word(cmd->cases->word);
+            int i;
 
-                if (append == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
-                if (dup2(append, 1) == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1); 
-                }
-                if (close(append) == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }       
+            if (!word) {
+                retval = -1;
+                break;
             }
-
-            if (cmd->error) {
-                int error = open(cmd->error, O_WRONLY | O_TRUNC | O_CREAT, filemode);
-
-                if (error == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
-                if (dup2(error, 2) == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
-                if (close(error) == -1) {
-                    fprintf(stderr, "error: %s\n", strerror(errno));
-                    exit(-1);
-                }
+            fflush(stdout);
+            if (redirect(cmd) == -1) {
+                free(word);
+                retval = -1;
+                break;
             }
-
-            // execute the command
-            execvp(cmd->args[0],cmd->args);
-
-            // if we get to this line, the command has failed
-            fprintf(stderr, "error: %s\n", strerror(errno));
-            exit(-1);
+            i = case_select(cmd->cases, word);
+            free(word);
+            // without a matching item (or with an empty one) the status is 0
+            exec_tail = tail;
+            retval = i >= 0 && cmd->cases->arm[i].body ? executeAux(cmd->cases->arm[i].body) : 0;
+            exec_tail = 0;
+            break;
         }
 
-        case C_VOID:
-        retval = executeAux(cmd->left);
-        break;
-
         case C_AND: {
             int error;  
 
             error = executeAux(cmd->left);
             if (!error) {
+                exec_tail = tail;
                 retval = executeAux(cmd->right);
             } else {
                 retval = error;
@@ -281,6 +1564,7 @@ int executeAux (struct cmd *cmd) {
 
             error = executeAux(cmd->left);
             if (error) {
+                exec_tail = tail;
                 retval = executeAux(cmd->right);
             } else {
                 retval = error;
@@ -290,15 +1574,47 @@ int executeAux (struct cmd *cmd) {
 
         case C_PIPE: {
             int filepipe[2];
+            long size = pipe_size(cmd);
+            pid_t pid, relaypid = -1;
+            struct stage *stage = NULL, *last = NULL;
+            struct cmd *right = cmd->right;
+            struct stagethread *feeder = NULL;
+            int stages = 0, feed;
 
+            // the builtins starting the pipeline run as threads, unless its
+            // pipes are instrumented; when the whole pipeline is builtins,
+            // the shell runs them itself, else a child does, or a thread of
+            // the shell for a single cat
+            if (!opt_pipestats) stages = stage_count(cmd, &right);
+            feed = stages == 1;
+            if (stages < 2) {
+                stages = 0;
+                right = cmd->right;
+            }
+            if (stages && !right) {
+                retval = stage_pipeline(cmd, stages, size);
+                break;
+            }
+            // the first pipe of an instrumented pipeline sets up its table
+            if (opt_pipestats && !stats) {
+                stats = mmap(NULL, sizeof(struct pipestats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+                if (stats == MAP_FAILED) stats = NULL;
+                else shown = stats;
+            }
+            if (stats) stage = stage_add(cmd->left);
             if (pipe(filepipe) == -1) {
                 fprintf(stderr, "error: %s\n", strerror(errno));
                 exit(-1);
             }
-            if (fork()) {
+            if (size) fcntl(filepipe[1], F_SETPIPE_SZ, size);
+            if (feed) feeder = feed_start(cmd->left, filepipe[1]);
+            if (feeder || (pid = fork())) {
                 // parent - handles the right command of the pipe
-                int statval;
+                int statval, owned;
+                long saved = pipe_override;
+                struct pipewatch *watch;
 
+                if (stage) relaypid = relay_start(filepipe, stage, size);
                 // close the unused part of the pipe
                 if (close(filepipe[1]) == -1) {
                     fprintf(stderr, "error: %s\n", strerror(errno));
@@ -317,10 +1633,33 @@ int executeAux (struct cmd *cmd) {
                     retval = -1; 
                     break;
                 }
-                // execute the right command
-                retval = executeAux(cmd->right);
+                // execute the right command; when it is a plain command,
+                // nothing reads the pipe after it
+                owned = stdin_owned;
+                stdin_owned = right->type == C_PLAIN;
+                // the size chosen holds for the rest of the pipeline
+                watch = opt_pipegrow ? pipe_watch_start(0) : NULL;
+                pipe_override = size;
+                if (stats && right->type != C_PIPE) last = stage_add(right);
+                retval = executeAux(right);
+                if (last) last->end = now_ns();
+                pipe_override = saved;
+                stdin_owned = owned;
+                pipe_watch_stop(watch);
+                // let go of the pipe, so that the left command stops on
+                // SIGPIPE if the right one did not read all of its output
+                if (dup2(in, 0) == -1) {
+                    fprintf(stderr, "error: %s\n", strerror(errno));
+                    retval = -1;
+                    break;
+                }
+                if (relaypid != -1) waitpid(relaypid, NULL, 0);
+                if (feeder) {
+                    retval = retval || feed_finish(feeder);
+                    break;
+                }
                 // wait for child to terminate
-                if (wait(&statval) == -1) {
+                if (waitpid(pid, &statval, 0) == -1) {
                     fprintf(stderr, "error: %s\n", strerror(errno));   
                     retval = -1;
                     break;
@@ -329,6 +1668,9 @@ int executeAux (struct cmd *cmd) {
                     // return the child's exit value
                     retval = retval || WEXITSTATUS(statval);
                     break;
+                } else if (WIFSIGNALED(statval) && WTERMSIG(statval) == SIGPIPE) {
+                    // the right command stopped reading: not an error
+                    break;
                 } else {
                     fprintf(stderr, "error: child process did not terminate with exit \n");
                     retval = -1;
@@ -337,6 +1679,12 @@ int executeAux (struct cmd *cmd) {
             } else {
                 // child - handles the left command of the pipe
 
+                // the output goes to the pipe, not to a command substitution
+                capture = NULL;
+                // a pipeline in the command has a table of its own
+                if (stats) stats_outer = stats;
+                stats = NULL;
+
                 // close the unused part of the pipe
                 if (close(filepipe[0]) == -1) {
                     fprintf(stderr, "error: %s\n", strerror(errno));
@@ -352,46 +1700,246 @@ int executeAux (struct cmd *cmd) {
                     fprintf(stderr, "error: %s\n", strerror(errno));
                     exit(-1);
                 }
-                // execute the left command
+                // execute the left command, the last thing the child does
+                if (stages) exit(stage_pipeline(cmd, stages, size));
+                exec_tail = 1;
                 exit(executeAux(cmd->left));
             }
         }
 
+        case C_MERGE: case C_CONCAT:
+            fflush(stdout);
+            if (redirect(cmd) == -1) {
+                retval = -1;
+                break;
+            }
+            retval = merge(cmd);
+            break;
+
         case C_SEQ:
+        if (opt_parallel) {
+            retval = seq_parallel(cmd, tail);
+            break;
+        }
         executeAux(cmd->left);
+        exec_tail = tail;
         retval = executeAux(cmd->right);
         break;
     }
 
-    if (dup2(in, 0) == -1) {
+    // the redirections of an exec builtin stay for the rest of the shell
+    if (kept != keptmark) {
+        close(in);
+        close(out);
+        close(err);
+        in = out = err = -1;
+    }
+
+    if (in != -1 && dup2(in, 0) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        exit(-1);
+    }
+    if (in != -1 && close(in) == -1) {
         fprintf(stderr, "error: %s\n", strerror(errno));
         exit(-1);
     }
-    if (close(in) == -1) {
+    if (out != -1 && dup2(out, 1) == -1) {
         fprintf(stderr, "error: %s\n", strerror(errno));
         exit(-1);
     }
-    if (dup2(out, 1) == -1) {
+    if (out != -1 && close(out) == -1) {
         fprintf(stderr, "error: %s\n", strerror(errno));
         exit(-1);
     }
-    if (dup2(err, 0) == -1) {
+    if (err != -1 && dup2(err, 2) == -1) {
         fprintf(stderr, "error: %s\n", strerror(errno));
         exit(-1);
     }
-    if (close(err) == -1) {
+    if (err != -1 && close(err) == -1) {
         fprintf(stderr, "error: %s\n", strerror(errno));
         exit(-1);
     }
 
+    // the substitutions end with the command, once its files are closed
+    procsub_done(procmark);
+    // and the compressed redirections, once their pipes are closed
+    if (zip_done(zipmark) == -1) retval = -1;
+
+    if (shown) {
+        fflush(stdout);
+        stats_show(shown);
+        if (stats_last) munmap(stats_last, sizeof(struct pipestats));
+        stats_last = shown;
+        stats = NULL;
+    }
+
+    // maintain the "?" variable
+    laststatus = retval;
     return retval;
 }
 
+// redirect a file to one of the shell's standard streams, through a
+// compressing or decompressing thread if zip is set
+static int redirect_file (char *word, int flags, mode_t mode, int fd, int zip) {
+    char *path = expand_word(word);
+    int file;
+
+    if (!path) {
+        return -1;
+    }
+    file = open(path, flags, mode);
+    free(path);
+
+    if (file == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+    if (zip) {
+        return zip_start(file, fd, fd != 0);
+    }
+    if (dup2(file, fd) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+    if (close(file) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// the size of a pipe's buffer; smaller here-documents are written to a pipe
+// without blocking, larger ones go to an anonymous in-memory file
+#define HERE_PIPEMAX 65536
+
+// redirect the expansion of a here-document to the shell's stdin
+static int redirect_here (char *word) {
+    char *body = expand_word(word), *s;
+    size_t len;
+    ssize_t w;
+    int fds[2];
+
+    if (!body) {
+        return -1;
+    }
+    len = strlen(body);
+
+    if (len <= HERE_PIPEMAX) {
+        if (pipe(fds) == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            free(body);
+            return -1;
+        }
+    } else {
+        fds[0] = fds[1] = memfd_create("here-document", 0);
+        if (fds[0] == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            free(body);
+            return -1;
+        }
+    }
+
+    for (s = body; len; s += w, len -= w) {
+        if ((w = write(fds[1], s, len)) == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            break;
+        }
+    }
+    free(body);
+    if (len) {
+        // the write failed
+        close(fds[0]);
+        if (fds[1] != fds[0]) close(fds[1]);
+        return -1;
+    }
+
+    // close the writing end of the pipe, or go back to the file's start
+    if (fds[1] != fds[0] ? close(fds[1]) == -1 : lseek(fds[0], 0, SEEK_SET) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        close(fds[0]);
+        return -1;
+    }
+    if (dup2(fds[0], 0) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        close(fds[0]);
+        return -1;
+    }
+    if (close(fds[0]) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// This function applies the redirections of a plain command to the shell's
+// stdin, stdout and stderr; executeAux restores them after the command
+int redirect (struct cmd *cmd) {
+    mode_t mask, filemode;
+
+    // get the current umask value
+    mask = umask(0);
+    umask (mask);
+    // compute the actual file permission mode
+    filemode = (0666) ^ mask;
+
+    if (cmd->input && redirect_file(cmd->input, O_RDONLY, 0, 0, cmd->zip & ZIP_INPUT) == -1) {
+        return -1;
+    }
+    if (cmd->here && redirect_here(cmd->here) == -1) {
+        return -1;
+    }
+    if (cmd->output && redirect_file(cmd->output, O_WRONLY | O_TRUNC | O_CREAT, filemode, 1, cmd->zip & ZIP_OUTPUT) == -1) {
+        return -1;
+    }
+    if (cmd->append && redirect_file(cmd->append, O_WRONLY | O_APPEND | O_CREAT, filemode, 1, cmd->zip & ZIP_APPEND) == -1) {
+        return -1;
+    }
+    if (cmd->error && redirect_file(cmd->error, O_WRONLY | O_TRUNC | O_CREAT, filemode, 2, 0) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// This function performs the variable assignments NAME=value of a command
+int assign (char **assigns, int flags) {
+    int i;
+
+    for (i = 0; assigns && assigns[i]; i++) {
+        size_t len = var_namelen(assigns[i]);
+        char *value = expand_word(assigns[i] + len + 1);
+
+        if (!value) {
+            return -1;
+        }
+        var_setn(assigns[i], len, value, flags);
+        free(value);
+    }
+    return 0;
+}
+
 // This function is used to propagate properly the redirections to the subcommands
 void propagate (struct cmd *cmd) {
     switch (cmd->type) {
         // the command has no subcommand
-        case C_PLAIN:
+        case C_PLAIN: case C_TEST:
+        return;
+
+        // the redirections of a case command are made by the shell around
+        // the commands of its items
+        case C_CASE: {
+            int i;
+
+            for (i = 0; i < cmd->cases->n; i++) {
+                if (cmd->cases->arm[i].body) propagate(cmd->cases->arm[i].body);
+            }
+            return;
+        }
+
+        // the redirections of a merge are made by the shell around the
+        // loop reading the outputs
+        case C_MERGE: case C_CONCAT:
+        propagate(cmd->left);
+        propagate(cmd->right);
         return;
 
         // handle the pipes properly: don't interfer with the pipe's in/out
@@ -410,6 +1958,9 @@ void propagate (struct cmd *cmd) {
         if (cmd->input && !(cmd->left)->input) {
             (cmd->left)->input = cmd->input;
         }
+        if (cmd->here && !(cmd->left)->here) {
+            (cmd->left)->here = cmd->here;
+        }
         if (cmd->error && !(cmd->left)->error) {
             (cmd->left)->error = cmd->error;
         }
@@ -423,6 +1974,9 @@ void propagate (struct cmd *cmd) {
         if (cmd->input && !(cmd->right)->input) {
             (cmd->right)->input = cmd->input;
         }
+        if (cmd->here && !(cmd->right)->here) {
+            (cmd->right)->here = cmd->here;
+        }
         if (cmd->output && !(cmd->right)->output) {
             (cmd->right)->output = cmd->output;
         }
@@ -439,6 +1993,9 @@ void propagate (struct cmd *cmd) {
         if (cmd->input && !(cmd->left)->input) {
             (cmd->left)->input = cmd->input;
         }
+        if (cmd->here && !(cmd->left)->here) {
+            (cmd->left)->here = cmd->here;
+        }
         if (cmd->output && !(cmd->left)->output) {
             (cmd->left)->output = cmd->output;
         }
@@ -451,3 +2008,29 @@ void propagate (struct cmd *cmd) {
         propagate(cmd->left);
     }
 }
+
+// This function returns the environment of a command run with prefix
+// assignments NAME=value, laid over the snapshot of the exported variables
+char **overlay (char **assigns) {
+    char **pairs, **env;
+    int i;
+
+    for (i = 0; assigns[i]; i++);
+    pairs = calloc(i + 1, sizeof(char*));
+    for (i = 0; assigns[i]; i++) {
+        size_t len = var_namelen(assigns[i]);
+        char *value = expand_word(assigns[i] + len + 1);
+
+        if (!value) {
+            while (i--) free(pairs[i]);
+            free(pairs);
+            return NULL;
+        }
+        pairs[i] = malloc(len + strlen(value) + 2);
+        sprintf(pairs[i], "%.*s=%s", (int) len, assigns[i], value);
+        free(value);
+    }
+    env = var_overlay(pairs);
+    free(pairs);
+    return env;
+}
@@ -14,13 +14,18 @@ void output_args (struct cmd *cmd, char *tabs)
 void output_mods (struct cmd *cmd, char *tabs)
 {
 	if (cmd->input)
-		printf("%sinput redirected to %s\n",tabs,cmd->input);
+		printf("%sinput redirected to %s%s\n",tabs,cmd->input,
+			cmd->zip & ZIP_INPUT ? ", decompressed" : "");
 	if (cmd->output)
-		printf("%soutput redirected to %s\n",tabs,cmd->output);
+		printf("%soutput redirected to %s%s\n",tabs,cmd->output,
+			cmd->zip & ZIP_OUTPUT ? ", compressed" : "");
 	if (cmd->append)
-		printf("%soutput appended to %s\n",tabs,cmd->append);
+		printf("%soutput appended to %s%s\n",tabs,cmd->append,
+			cmd->zip & ZIP_APPEND ? ", compressed" : "");
 	if (cmd->error)
 		printf("%serror redirected to %s\n",tabs,cmd->error);
+	if (cmd->here)
+		printf("%sinput from here-document %s\n",tabs,cmd->here);
 }
 
 // outputs the structure of the parsed command; useful for debugging
@@ -51,6 +56,25 @@ void output (struct cmd *cmd, int indent)
 		output(cmd->left,indent+1);
 		printf("%sparenthese over\n",tabs);
 		break;
+	    case C_TEST:
+		printf("%sa [[ ]] test\n",tabs);
+		output_args(cmd,tabs);
+		output_mods(cmd,tabs);
+		break;
+	    case C_CASE:
+		printf("%sa case command on %s\n",tabs,cmd->cases->word);
+		output_mods(cmd,tabs);
+		for (i = 0; i < cmd->cases->n; i++) {
+			int j;
+			printf("%spatterns:",tabs);
+			for (j = 0; cmd->cases->arm[i].pats[j]; j++)
+				printf(" [%s]",cmd->cases->arm[i].pats[j]);
+			printf("\n");
+			if (cmd->cases->arm[i].body)
+				output(cmd->cases->arm[i].body,indent+1);
+		}
+		printf("%scase over\n",tabs);
+		break;
 	    case C_AND:
 		if (cmd->type == C_AND)
 			printf("%sAND (if the left command succeeds, "
@@ -63,6 +87,14 @@ void output (struct cmd *cmd, int indent)
 		if (cmd->type == C_PIPE)
 			printf("%sPIPE (redirect output of the left command "
 				"to the right)\n",tabs);
+	    case C_MERGE:
+		if (cmd->type == C_MERGE)
+			printf("%sMERGE (run the left and right commands at once, "
+				"merging their output lines)\n",tabs);
+	    case C_CONCAT:
+		if (cmd->type == C_CONCAT)
+			printf("%sCONCAT (run the left and right commands at once, "
+				"the output of the left first)\n",tabs);
 	    case C_SEQ:
 		if (cmd->type == C_SEQ)
 			printf("%sSEQUENCE (execute the left command, "
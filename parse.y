@@ -7,9 +7,14 @@
 #include "global.h"
 
 struct cmd* cmdline;
+int parse_incomplete;
+static int parse_more;
 int yylex();
 void yyerror (char*);
 
+static char **arglist_vector (struct arglist*);
+static struct cases *case_add (struct cases*,struct casearm*);
+
 %}
 
 %union 
@@ -18,25 +23,34 @@ void yyerror (char*);
 	struct arglist* arglist;
  	char **args;
 	struct cmd* cmd;
+	struct cases* cases;
+	struct casearm* arm;
 	int token;
 }
 
-%token <string> ARG
+%token <string> ARG HERE
 %token PIPE AND OR SEQ APPEND OUTPUT INPUT ERROR PLAIN VOID
+%token CASE IN ESAC DSEMI PATEND TEST TESTEND MERGE CONCAT
+%token ZINPUT ZOUTPUT ZAPPEND
 
 %type <cmd> single line mods
 %type <args> args
 %type <token> op dir
-%type <arglist> arglist
+%type <arglist> arglist pats
+%type <cases> cases
+%type <arm> arm
 
-%left AND OR PIPE
+%left AND OR PIPE MERGE CONCAT
 
 %%
 
-main    : line
+main    : /* empty */
+	  { cmdline = NULL; }
+	| line
 	  { cmdline = $1; }
 
 line    : single
+	| single SEQ
 	| single op line
 	  {
 		$$ = calloc(1,sizeof(struct cmd));
@@ -48,8 +62,17 @@ line    : single
 
 single  : args mods
 	  {
+		int n = 0, i, len;
 		$$ = $2;
 		$$->type = C_PLAIN;
+		// leading NAME=value words are variable assignments
+		while ($1[n] && (len = var_namelen($1[n])) && $1[n][len] == '=')
+			n++;
+		if (n) {
+			$$->assigns = calloc(n+1,sizeof(char*));
+			memcpy($$->assigns,$1,n*sizeof(char*));
+			for (i = 0; ($1[i] = $1[i+n]); i++);
+		}
 		$$->args = $1;
 	  }
 	| '(' line ')' mods
@@ -58,20 +81,69 @@ single  : args mods
 		$$->type = C_VOID;
 		$$->left = $2;
 	  }
+	| TEST args TESTEND mods
+	  {
+		$$ = $4;
+		$$->type = C_TEST;
+		$$->args = $2;
+	  }
+	| CASE ARG IN cases ESAC mods
+	  {
+		$$ = $6;
+		$$->type = C_CASE;
+		$$->cases = $4;
+		$4->word = $2;
+	  }
+	| CASE ARG IN cases arm ESAC mods
+	  {
+		$$ = $7;
+		$$->type = C_CASE;
+		$$->cases = case_add($4,$5);
+		$4->word = $2;
+	  }
 
-args     : arglist
+cases   : /* empty */
 	  {
-		int cnt = 0;
-		struct arglist *pt = $1, *tmp;
-		while (pt) { pt = pt->next; cnt++; }
-		$$ = calloc(cnt+1,sizeof(char*));
-		pt = $1; cnt = 0;
-		while (pt) {
-			$$[cnt++] = pt->arg;
-			tmp = pt; pt = pt->next; free(tmp);
-		}
+		$$ = calloc(1,sizeof(struct cases));
+		$$->set = patset_new();
+	  }
+	| cases arm DSEMI
+	  { $$ = case_add($1,$2); }
+
+arm     : pats PATEND
+	  {
+		$$ = calloc(1,sizeof(struct casearm));
+		$$->pats = arglist_vector($1);
+	  }
+	| pats PATEND line
+	  {
+		$$ = calloc(1,sizeof(struct casearm));
+		$$->pats = arglist_vector($1);
+		$$->body = $3;
 	  }
 
+pats    : ARG
+	  {
+		$$ = calloc(1,sizeof(struct arglist));
+		$$->arg = $1;
+	  }
+	| '(' ARG
+	  {
+		$$ = calloc(1,sizeof(struct arglist));
+		$$->arg = $2;
+	  }
+	| pats PIPE ARG
+	  {
+		struct arglist* pt;
+		pt = $$ = $1;
+		while (pt->next) { pt = pt->next; }
+		pt->next = calloc(1,sizeof(struct arglist));
+		pt->next->arg = $3;
+	  }
+
+args     : arglist
+	  { $$ = arglist_vector($1); }
+
 arglist : ARG
 	  {
 		$$ = calloc(1,sizeof(struct arglist));
@@ -89,34 +161,115 @@ arglist : ARG
 mods    : { $$ = calloc(1,sizeof(struct cmd)); }
 	| mods dir ARG
 	  { $$ = $1;
-	    if ($2 == INPUT)  { $$->input = $3; }
-	    if ($2 == OUTPUT) { $$->output = $3; }
-	    if ($2 == APPEND) { $$->append = $3; }
+	    if ($2 == INPUT || $2 == ZINPUT)   { $$->input = $3; }
+	    if ($2 == OUTPUT || $2 == ZOUTPUT) { $$->output = $3; }
+	    if ($2 == APPEND || $2 == ZAPPEND) { $$->append = $3; }
 	    if ($2 == ERROR)  { $$->error = $3; }
+	    // the last redirection of a kind says if it is compressed
+	    if ($2 == INPUT)   { $$->zip &= ~ZIP_INPUT; }
+	    if ($2 == OUTPUT)  { $$->zip &= ~ZIP_OUTPUT; }
+	    if ($2 == APPEND)  { $$->zip &= ~ZIP_APPEND; }
+	    if ($2 == ZINPUT)  { $$->zip |= ZIP_INPUT; }
+	    if ($2 == ZOUTPUT) { $$->zip |= ZIP_OUTPUT; }
+	    if ($2 == ZAPPEND) { $$->zip |= ZIP_APPEND; }
+	  }
+
+	| mods HERE
+	  { $$ = $1;
+	    $$->here = $2;
 	  }
 
 dir     : INPUT  { $$ = INPUT;  }
 	| OUTPUT { $$ = OUTPUT; }
 	| APPEND { $$ = APPEND; }
 	| ERROR  { $$ = ERROR;  }
+	| ZINPUT  { $$ = ZINPUT;  }
+	| ZOUTPUT { $$ = ZOUTPUT; }
+	| ZAPPEND { $$ = ZAPPEND; }
 
 op      : PIPE { $$ = C_PIPE; }
 	| AND  { $$ = C_AND;  }
 	| OR   { $$ = C_OR;   }
 	| SEQ  { $$ = C_SEQ;  }
+	| MERGE  { $$ = C_MERGE;  }
+	| CONCAT { $$ = C_CONCAT; }
 
 %%
 
 #include "lex.c"
 
+// turn a list of words into a NULL-terminated vector, freeing the list
+static char **arglist_vector (struct arglist *list)
+{
+	int cnt = 0;
+	struct arglist *pt = list, *tmp;
+	char **v;
+	while (pt) { pt = pt->next; cnt++; }
+	v = calloc(cnt+1,sizeof(char*));
+	pt = list; cnt = 0;
+	while (pt) {
+		v[cnt++] = pt->arg;
+		tmp = pt; pt = pt->next; free(tmp);
+	}
+	return v;
+}
+
+// whether a pattern word depends on the moment the command runs
+static int case_dynamic (char *word)
+{
+	return strchr(word,'$') || ((*word == '<' || *word == '>') && word[1] == '(');
+}
+
+// append an item to a case command; its patterns that don't need to be
+// expanded are compiled into the pattern set of the command now, so that
+// selecting the item doesn't go through them one by one
+static struct cases *case_add (struct cases *c, struct casearm *arm)
+{
+	int i, n = 0;
+
+	for (i = 0; arm->pats[i]; i++);
+	arm->dynamic = calloc(i+1,sizeof(char*));
+	for (i = 0; arm->pats[i]; i++) {
+		struct pattern *p;
+
+		if (case_dynamic(arm->pats[i])) {
+			arm->dynamic[n++] = arm->pats[i];
+		} else if (!strpbrk(arm->pats[i],"'\"")) {
+			// a word without quotes is its own pattern: compiling it
+			// through the cache would push the patterns in use out
+			patset_add(c->set, pat_compile(arm->pats[i],strlen(arm->pats[i])), c->n);
+		} else if ((p = expand_pattern(arm->pats[i]))) {
+			patset_add(c->set, pat_compile(p->text,p->textlen), c->n);
+		}
+	}
+	c->arm = realloc(c->arm, (c->n+1) * sizeof(struct casearm));
+	c->arm[c->n++] = *arm;
+	free(arm);
+	return c;
+}
+
 void yyerror (char *info)
 { 
+	// a command cut at the end of the input may be completed by more input
+	if (yychar == YYEOF || lex_incomplete) {
+		parse_incomplete = 1;
+		if (parse_more) return;
+	}
 	fprintf(stderr,"cannot parse input: %s; discarded\n",info);
 }
 
-struct cmd* parser (char *command)
+// parse a command; if more is set and the input ends in the middle of the
+// command, NULL is returned silently with parse_incomplete set, so that
+// the caller can read more input and try again
+struct cmd* parser (char *command, int more)
 {
+	parse_more = more;
+	parse_incomplete = 0;
 	yy_scan_string(command);
 	if (yyparse()) return NULL;
+	if (lex_incomplete) {
+		yyerror("unexpected end of input");
+		return NULL;
+	}
 	return cmdline;
 }
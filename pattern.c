@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "global.h"
+
+// Glob patterns (*, ?, [...] and \-escapes) compiled into a small program.
+// Patterns made of a literal string and stars at its ends, the common case
+// in scripts (${path##*/}, ${file%.*}, "*.c"), are matched by the string
+// functions instead of running the program.
+
+enum { N_CHAR, N_ANY, N_STAR, N_CLASS };
+
+struct pnode {
+    unsigned char op;
+    unsigned char c;            // the character of N_CHAR
+    unsigned char set[32];      // the bitmap of N_CLASS
+};
+
+// the compiled patterns are kept in a small cache keyed by their text, so
+// that a pattern used in a loop is only compiled once
+#define PAT_CACHE 256
+
+static struct pattern *cache[PAT_CACHE];
+static int cached;
+
+static int inset (const unsigned char *set, unsigned char c) {
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+static void addset (unsigned char *set, unsigned char c) {
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+// compile the bracket expression at text[*i], which starts after the '['
+static int compile_class (const char *text, size_t len, size_t *i, unsigned char *set) {
+    size_t j = *i;
+    int negate = 0, k;
+
+    if (j < len && (text[j] == '!' || text[j] == '^')) {
+        negate = 1;
+        j++;
+    }
+    // a ']' right after the '[' is taken literally
+    if (j < len && text[j] == ']') {
+        addset(set, ']');
+        j++;
+    }
+    while (j < len && text[j] != ']') {
+        unsigned char lo = text[j], hi;
+
+        if (lo == '\\' && j + 1 < len) lo = text[++j];
+        hi = lo;
+        if (j + 2 < len && text[j+1] == '-' && text[j+2] != ']') {
+            j += 2;
+            hi = text[j];
+            if (hi == '\\' && j + 1 < len) hi = text[++j];
+        }
+        for (k = lo; k <= hi; k++) addset(set, k);
+        j++;
+    }
+    if (j >= len) return -1;    // no closing ']': not a class
+    if (negate) {
+        for (k = 0; k < 32; k++) set[k] = ~set[k];
+    }
+    *i = j + 1;
+    return 0;
+}
+
+struct pattern *pat_compile (const char *text, size_t len) {
+    struct pattern *p = calloc(1, sizeof(struct pattern));
+    size_t i, first, last;
+
+    p->text = strndup(text, len);
+    p->textlen = len;
+    p->node = calloc(len + 1, sizeof(struct pnode));
+    for (i = 0; i < len; ) {
+        struct pnode *n = &p->node[p->nnodes];
+
+        switch (text[i]) {
+            case '*':
+                i++;
+                // consecutive stars match like a single one
+                if (p->nnodes && n[-1].op == N_STAR) continue;
+                n->op = N_STAR;
+                break;
+            case '?':
+                i++;
+                n->op = N_ANY;
+                break;
+            case '[':
+                i++;
+                n->op = N_CLASS;
+                if (compile_class(text, len, &i, n->set) == 0) break;
+                memset(n->set, 0, sizeof(n->set));
+                n->op = N_CHAR;
+                n->c = '[';
+                break;
+            case '\\':
+                if (i + 1 < len) i++;
+                // fall through
+            default:
+                n->op = N_CHAR;
+                n->c = text[i++];
+        }
+        if (n->op != N_STAR) p->minlen++;
+        p->nnodes++;
+    }
+
+    // look for a literal between optional stars
+    first = p->nnodes && p->node[0].op == N_STAR;
+    last = p->nnodes - (p->nnodes > first && p->node[p->nnodes - 1].op == N_STAR);
+    for (i = first; i < last && p->node[i].op == N_CHAR; i++);
+    if (i == last) {
+        p->lit = malloc(last - first + 1);
+        for (i = first; i < last; i++) p->lit[p->litlen++] = p->node[i].c;
+        p->lit[p->litlen] = 0;
+        if (!first && last == (size_t) p->nnodes) p->kind = P_EXACT;
+        else if (!first) p->kind = P_PREFIX;
+        else if (last == (size_t) p->nnodes) p->kind = P_SUFFIX;
+        else p->kind = P_INFIX;
+    } else {
+        p->kind = P_GLOB;
+    }
+    return p;
+}
+
+void pat_free (struct pattern *p) {
+    free(p->text);
+    free(p->lit);
+    free(p->node);
+    free(p);
+}
+
+// return the compiled pattern for text, compiling it on the first use
+struct pattern *pat_get (const char *text, size_t len) {
+    int i;
+
+    for (i = 0; i < cached; i++) {
+        struct pattern *p = cache[i];
+
+        if (p->textlen == len && memcmp(p->text, text, len) == 0) {
+            // move it to the front, so the patterns in use are found first
+            memmove(cache + 1, cache, i * sizeof(struct pattern*));
+            return cache[0] = p;
+        }
+    }
+    if (cached == PAT_CACHE) pat_free(cache[--cached]);
+    memmove(cache + 1, cache, cached++ * sizeof(struct pattern*));
+    return cache[0] = pat_compile(text, len);
+}
+
+static int node_match (struct pnode *n, unsigned char c) {
+    switch (n->op) {
+        case N_CHAR:  return n->c == c;
+        case N_CLASS: return inset(n->set, c);
+        default:      return 1;
+    }
+}
+
+// match the program against the whole of s, backtracking to the last star
+static int glob_match (struct pattern *p, const char *s, size_t n) {
+    int pi = 0, star = -1;
+    size_t si = 0, mark = 0;
+
+    while (si < n) {
+        if (pi < p->nnodes && p->node[pi].op == N_STAR) {
+            star = ++pi;
+            mark = si;
+        } else if (pi < p->nnodes && node_match(&p->node[pi], s[si])) {
+            pi++;
+            si++;
+        } else if (star >= 0) {
+            pi = star;
+            si = ++mark;
+        } else {
+            return 0;
+        }
+    }
+    while (pi < p->nnodes && p->node[pi].op == N_STAR) pi++;
+    return pi == p->nnodes;
+}
+
+// position of the first (or last) occurrence of the literal in s, or -1
+static long find_lit (struct pattern *p, const char *s, size_t n, int last) {
+    long i;
+
+    if (p->litlen > n) return -1;
+    if (!last) {
+        const char *hit = memmem(s, n, p->lit, p->litlen);
+        return hit ? hit - s : -1;
+    }
+    for (i = n - p->litlen; i >= 0; i--) {
+        if (memcmp(s + i, p->lit, p->litlen) == 0) return i;
+    }
+    return -1;
+}
+
+// whether the pattern matches the whole of s[0..n)
+int pat_match (struct pattern *p, const char *s, size_t n) {
+    if (n < p->minlen) return 0;
+    switch (p->kind) {
+        case P_EXACT:  return n == p->litlen && memcmp(s, p->lit, n) == 0;
+        case P_PREFIX: return memcmp(s, p->lit, p->litlen) == 0;
+        case P_SUFFIX: return memcmp(s + n - p->litlen, p->lit, p->litlen) == 0;
+        case P_INFIX:  return find_lit(p, s, n, 0) >= 0;
+        default:       return glob_match(p, s, n);
+    }
+}
+
+// length of the shortest (or longest) prefix of s the pattern matches, or -1
+long pat_prefix (struct pattern *p, const char *s, size_t n, int longest) {
+    long i;
+
+    if (n < p->minlen) return -1;
+    switch (p->kind) {
+        case P_EXACT:
+            return memcmp(s, p->lit, p->litlen) ? -1 : (long) p->litlen;
+        case P_PREFIX:
+            if (memcmp(s, p->lit, p->litlen)) return -1;
+            return longest ? (long) n : (long) p->litlen;
+        case P_SUFFIX:
+            i = find_lit(p, s, n, longest);
+            return i < 0 ? -1 : i + (long) p->litlen;
+        case P_INFIX:
+            i = find_lit(p, s, n, 0);
+            if (i < 0) return -1;
+            return longest ? (long) n : i + (long) p->litlen;
+    }
+    if (longest) {
+        for (i = n; i >= (long) p->minlen; i--) {
+            if (glob_match(p, s, i)) return i;
+        }
+    } else {
+        for (i = p->minlen; i <= (long) n; i++) {
+            if (glob_match(p, s, i)) return i;
+        }
+    }
+    return -1;
+}
+
+// start of the shortest (or longest) suffix of s the pattern matches, or -1
+long pat_suffix (struct pattern *p, const char *s, size_t n, int longest) {
+    long i;
+
+    if (n < p->minlen) return -1;
+    switch (p->kind) {
+        case P_EXACT:
+        case P_SUFFIX:
+            if (memcmp(s + n - p->litlen, p->lit, p->litlen)) return -1;
+            return longest && p->kind == P_SUFFIX ? 0 : (long) (n - p->litlen);
+        case P_PREFIX:
+            return find_lit(p, s, n, !longest);
+        case P_INFIX:
+            i = find_lit(p, s, n, 1);
+            if (i < 0) return -1;
+            return longest ? 0 : i;
+    }
+    if (longest) {
+        for (i = 0; i <= (long) (n - p->minlen); i++) {
+            if (glob_match(p, s + i, n - i)) return i;
+        }
+    } else {
+        for (i = n - p->minlen; i >= 0; i--) {
+            if (glob_match(p, s + i, n - i)) return i;
+        }
+    }
+    return -1;
+}
+
+// position of the first longest match of the pattern in s, or -1; its
+// length is stored in *len
+long pat_find (struct pattern *p, const char *s, size_t n, size_t *len) {
+    long i, end;
+
+    switch (p->kind) {
+        case P_EXACT:
+            i = find_lit(p, s, n, 0);
+            *len = p->litlen;
+            return i;
+        case P_PREFIX:
+            i = find_lit(p, s, n, 0);
+            *len = n - i;
+            return i;
+    }
+    for (i = 0; i <= (long) n; i++) {
+        if ((end = pat_prefix(p, s + i, n - i, 1)) >= 0) {
+            *len = end;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A set of patterns, each selecting an alternative by its index, as the
+// items of a case command.  The literal patterns are found with a single
+// hash lookup of the subject; the others are tried in order, but only
+// until the alternative found by the lookup.
+struct patset {
+    struct {
+        struct pattern *pat;
+        int index;
+    } *hash, *other;
+    int hashsize, nhash;
+    int nother, othercap;
+};
+
+static unsigned long lit_hash (const char *s, size_t n) {
+    unsigned long h = 2166136261UL;
+
+    while (n--) h = (h ^ (unsigned char) *s++) * 16777619UL;
+    return h;
+}
+
+struct patset *patset_new (void) {
+    return calloc(1, sizeof(struct patset));
+}
+
+// the hash slot of the literal s[0..n), or of the empty slot where it goes
+static int lit_slot (struct patset *set, const char *s, size_t n) {
+    int i = lit_hash(s, n) & (set->hashsize - 1);
+
+    while (set->hash[i].pat) {
+        struct pattern *p = set->hash[i].pat;
+
+        if (p->litlen == n && memcmp(p->lit, s, n) == 0) break;
+        i = (i + 1) & (set->hashsize - 1);
+    }
+    return i;
+}
+
+// add a compiled pattern, which the set then owns; the indexes must be
+// added in increasing order
+void patset_add (struct patset *set, struct pattern *p, int index) {
+    int i;
+
+    if (p->kind != P_EXACT) {
+        if (set->nother == set->othercap) {
+            set->othercap = set->othercap ? 2 * set->othercap : 8;
+            set->other = realloc(set->other, set->othercap * sizeof(*set->other));
+        }
+        set->other[set->nother].pat = p;
+        set->other[set->nother++].index = index;
+        return;
+    }
+
+    // keep the table at most half full
+    if (2 * (set->nhash + 1) > set->hashsize) {
+        struct patset old = *set;
+
+        set->hashsize = old.hashsize ? 2 * old.hashsize : 16;
+        set->hash = calloc(set->hashsize, sizeof(*set->hash));
+        for (i = 0; i < old.hashsize; i++) {
+            if (old.hash[i].pat) {
+                set->hash[lit_slot(set, old.hash[i].pat->lit, old.hash[i].pat->litlen)] = old.hash[i];
+            }
+        }
+        free(old.hash);
+    }
+    i = lit_slot(set, p->lit, p->litlen);
+    // an earlier alternative with the same literal hides this one
+    if (set->hash[i].pat) {
+        pat_free(p);
+        return;
+    }
+    set->hash[i].pat = p;
+    set->hash[i].index = index;
+    set->nhash++;
+}
+
+// the lowest index of the patterns matching s[0..n), or -1
+int patset_match (struct patset *set, const char *s, size_t n) {
+    int best = -1, i;
+
+    if (set->nhash) {
+        i = lit_slot(set, s, n);
+        if (set->hash[i].pat) best = set->hash[i].index;
+    }
+    for (i = 0; i < set->nother && (best < 0 || set->other[i].index < best); i++) {
+        if (pat_match(set->other[i].pat, s, n)) return set->other[i].index;
+    }
+    return best;
+}
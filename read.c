@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "global.h"
+
+// The builtins reading lines from the standard input: read and mapfile
+// (also called readarray).  A builtin shares its input with the commands
+// run after it, so it may not take more than the lines it returns.  When
+// the input is a regular file it is read in blocks anyway, and the offset
+// moved back to the end of the last line taken; a file large enough that
+// is read to the end is mapped rather than read.  When it is a pipe the
+// shell made for the command, nothing else reads it, and the rest of a
+// block is thrown away.  Otherwise it is read one byte at a time.
+
+#define READ_BLOCK 4096     // first block of read, doubled for longer lines
+#define MAPFILE_BLOCK 65536
+#define MAP_MIN 65536       // the smallest rest of a file mapped
+
+// set by a pipeline while the command reading its pipe is a plain command
+int stdin_owned;
+
+struct input {
+    char *s;
+    size_t pos, len, cap;
+    size_t block;       // size of the next read, 1 when reading bytes
+    int seekable;       // the bytes read past pos are given back with lseek
+    int eof;
+    int error;
+    char *map;          // the mapping of the file, if it is mapped
+    size_t maplen;
+    off_t start;        // the offset of s in the file when mapped
+};
+
+// prepare to read the standard input; all is set if it is read to the end
+static void in_start (struct input *in, size_t block, int all) {
+    struct stat st;
+    off_t at;
+
+    memset(in, 0, sizeof(struct input));
+    in->block = 1;
+    if (fstat(0, &st) == -1) return;
+    in->seekable = S_ISREG(st.st_mode) && (in->start = lseek(0, 0, SEEK_CUR)) != -1;
+    if (all || in->seekable || (S_ISFIFO(st.st_mode) && stdin_owned)) in->block = block;
+
+    // the rest of a file read to the end is mapped from the page it starts
+    // in, and taken as a single block; for a line or a few, mapping and
+    // unmapping it costs more than reading a block
+    if (all && in->seekable && st.st_size - in->start >= MAP_MIN) {
+        at = in->start & ~(off_t) (sysconf(_SC_PAGESIZE) - 1);
+        in->maplen = st.st_size - at;
+        if ((in->map = mmap(NULL, in->maplen, PROT_READ, MAP_PRIVATE, 0, at)) == MAP_FAILED) {
+            in->map = NULL;
+            return;
+        }
+        in->s = in->map + (in->start - at);
+        in->len = st.st_size - in->start;
+        in->eof = 1;
+    }
+}
+
+// read more of the input after the buffered bytes; returns 0 at the end
+static int in_fill (struct input *in) {
+    ssize_t n;
+
+    if (in->eof) return 0;
+    if (in->pos == in->len) in->pos = in->len = 0;
+    if (in->cap - in->len < in->block) {
+        while (in->cap - in->len < in->block) in->cap = in->cap ? 2 * in->cap : in->block;
+        in->s = realloc(in->s, in->cap);
+    }
+    while ((n = read(0, in->s + in->len, in->block)) == -1 && errno == EINTR);
+    if (n <= 0) {
+        if (n == -1) {
+            fprintf(stderr, "error: %s\n", strerror(errno));
+            in->error = 1;
+        }
+        in->eof = 1;
+        return 0;
+    }
+    in->len += n;
+    // a longer line takes fewer reads
+    if (in->block > 1 && in->block < MAPFILE_BLOCK) in->block *= 2;
+    return 1;
+}
+
+// append the next line of the input to line, without its delimiter, and
+// set *ended if it had one; returns 0 at the end of the input
+static int in_line (struct input *in, int delim, struct buf *line, int *ended) {
+    int any = 0;
+
+    *ended = 0;
+    for (;;) {
+        char *s = in->s + in->pos, *e;
+        size_t n = in->len - in->pos;
+
+        if (n && (e = memchr(s, delim, n))) {
+            buf_add(line, s, e - s);
+            in->pos += e - s + 1;
+            *ended = 1;
+            return 1;
+        }
+        if (n) {
+            buf_add(line, s, n);
+            in->pos = in->len;
+            any = 1;
+        }
+        if (!in_fill(in)) return any;
+    }
+}
+
+// give back what was read past the lines taken
+static void in_end (struct input *in) {
+    if (in->map) {
+        lseek(0, in->start + in->pos, SEEK_SET);
+        munmap(in->map, in->maplen);
+        return;
+    }
+    if (in->seekable && in->pos < in->len) lseek(0, -(off_t) (in->len - in->pos), SEEK_CUR);
+    free(in->s);
+}
+
+static int is_ifs (const char *ifs, char c) {
+    return c && strchr(ifs, c);
+}
+
+static int is_space (const char *ifs, char c) {
+    return is_ifs(ifs, c) && isspace((unsigned char) c);
+}
+
+// scan the field of s[0..len) starting at pos into out, or the whole rest
+// if rest is set; backslashes quote the next character unless raw is set.
+// Returns the start of the next field.
+static size_t read_field (const char *s, size_t len, size_t pos, const char *ifs, int raw, int rest, struct buf *out) {
+    size_t keep = 0;
+
+    while (pos < len) {
+        if (s[pos] == '\\' && !raw && pos + 1 < len) {
+            buf_addc(out, s[pos + 1]);
+            keep = out->len;
+            pos += 2;
+            continue;
+        }
+        if (!rest && is_ifs(ifs, s[pos])) break;
+        buf_addc(out, s[pos]);
+        if (!is_space(ifs, s[pos])) keep = out->len;
+        pos++;
+    }
+    // the trailing blanks of the rest of the line are dropped
+    if (rest) {
+        out->len = keep;
+        if (out->s) out->s[keep] = 0;
+        return pos;
+    }
+    // a separator is blanks around at most one other character of $IFS
+    while (pos < len && is_space(ifs, s[pos])) pos++;
+    if (pos < len && is_ifs(ifs, s[pos]) && !is_space(ifs, s[pos])) {
+        for (pos++; pos < len && is_space(ifs, s[pos]); pos++);
+    }
+    return pos;
+}
+
+static int read_usage (const char *name) {
+    if (!strcmp(name, "read")) {
+        fprintf(stderr, "error: read: usage: read [-r] [-d delim] [-a array] [name ...]\n");
+    } else {
+        fprintf(stderr, "error: %s: usage: %s [-t] [-n count] [-s count] [-d delim] [array]\n", name, name);
+    }
+    return -1;
+}
+
+// builtin "read" (read a line into the variables named, split on $IFS, the
+// last one taking the rest of the line; -r keeps the backslashes, -d sets
+// the delimiter, -a stores the fields in an array).  The status is 1 at the
+// end of the input.
+int builtin_read (char **args) {
+    struct input in;
+    struct buf line, field;
+    char *array = NULL, *reply[] = { "REPLY", NULL }, **names;
+    const char *ifs;
+    int i, raw = 0, delim = '\n', got, ended, retval = 0;
+    size_t pos;
+
+    for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (!strcmp(args[i], "--")) {
+            i++;
+            break;
+        } else if (!strcmp(args[i], "-r")) {
+            raw = 1;
+        } else if (!strcmp(args[i], "-d") && args[i+1]) {
+            delim = args[++i][0];
+        } else if (!strcmp(args[i], "-a") && args[i+1]) {
+            array = args[++i];
+        } else {
+            return read_usage(args[0]);
+        }
+    }
+    names = args[i] ? args + i : reply;
+    if (!(ifs = var_get("IFS"))) ifs = " \t\n";
+
+    memset(&line, 0, sizeof(struct buf));
+    memset(&field, 0, sizeof(struct buf));
+    in_start(&in, READ_BLOCK, 0);
+    got = in_line(&in, delim, &line, &ended);
+    // a backslash at the end of a line continues it on the next one
+    while (got && ended && !raw && line.len && line.s[line.len - 1] == '\\') {
+        line.len--;
+        got = in_line(&in, delim, &line, &ended);
+    }
+    in_end(&in);
+    if (in.error) retval = -1;
+    else if (!got) retval = 1;
+
+    buf_addc(&line, 0);
+    line.len--;
+    for (pos = 0; pos < line.len && is_space(ifs, line.s[pos]); pos++);
+    if (array) {
+        char **v = NULL;
+        size_t n = 0;
+
+        while (pos < line.len) {
+            field.len = 0;
+            pos = read_field(line.s, line.len, pos, ifs, raw, 0, &field);
+            v = realloc(v, (n + 1) * sizeof(char*));
+            v[n++] = strndup(field.s ? field.s : "", field.len);
+        }
+        var_seta(array, v, n);
+        while (n) free(v[--n]);
+        free(v);
+    } else if (names == reply) {
+        // REPLY takes the line as it is
+        field.len = 0;
+        read_field(line.s, line.len, 0, "", raw, 1, &field);
+        var_setn("REPLY", 5, field.s ? field.s : "", 0);
+    } else {
+        for (i = 0; names[i]; i++) {
+            field.len = 0;
+            if (field.s) field.s[0] = 0;
+            pos = read_field(line.s, line.len, pos, ifs, raw, !names[i+1], &field);
+            if (var_set(names[i], field.s ? field.s : "", 0)) {
+                fprintf(stderr, "error: read: %s: not a valid identifier\n", names[i]);
+                retval = -1;
+            }
+        }
+    }
+    free(line.s);
+    free(field.s);
+    return retval;
+}
+
+// builtin "mapfile" or "readarray" (store the lines of the input in an
+// array, MAPFILE by default; -t removes the delimiters, -n reads at most
+// count lines, -s skips the first count lines, -d sets the delimiter)
+int builtin_mapfile (char **args) {
+    struct input in;
+    struct buf line;
+    char *array = "MAPFILE", **v = NULL;
+    long count = -1, skip = 0;
+    int i, trim = 0, delim = '\n', ended, retval = 0;
+    size_t n = 0, cap = 0;
+
+    for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (!strcmp(args[i], "--")) {
+            i++;
+            break;
+        } else if (!strcmp(args[i], "-t")) {
+            trim = 1;
+        } else if (!strcmp(args[i], "-d") && args[i+1]) {
+            delim = args[++i][0];
+        } else if (!strcmp(args[i], "-n") && args[i+1]) {
+            count = atol(args[++i]);
+            if (count == 0) count = -1;
+        } else if (!strcmp(args[i], "-s") && args[i+1]) {
+            skip = atol(args[++i]);
+        } else {
+            return read_usage(args[0]);
+        }
+    }
+    if (args[i]) array = args[i];
+    if (!var_namelen(array) || array[var_namelen(array)]) {
+        fprintf(stderr, "error: %s: %s: not a valid identifier\n", args[0], array);
+        return -1;
+    }
+
+    // all of the input is taken unless the lines are counted
+    memset(&line, 0, sizeof(struct buf));
+    in_start(&in, MAPFILE_BLOCK, count < 0);
+    while (count && in_line(&in, delim, &line, &ended)) {
+        if (skip > 0) {
+            skip--;
+        } else {
+            if (ended && !trim) buf_addc(&line, delim);
+            if (n == cap) {
+                cap = cap ? 2 * cap : 64;
+                v = realloc(v, cap * sizeof(char*));
+            }
+            v[n++] = strndup(line.s ? line.s : "", line.len);
+            if (count > 0) count--;
+        }
+        line.len = 0;
+    }
+    in_end(&in);
+    if (in.error) retval = -1;
+
+    var_seta(array, v, n);
+    while (n) free(v[--n]);
+    free(v);
+    free(line.s);
+    return retval;
+}
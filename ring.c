@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "global.h"
+
+// The ring buffers joining the builtins of a pipeline run as threads (see
+// stage_pipeline in main.c).  A ring has a single writer and a single
+// reader, each moving its own index only, so that data goes through it
+// without a lock; the lock and the condition are only taken by the side
+// that has to wait, and by the other one to wake it up.
+
+struct ring {
+    char *s;
+    size_t size;                // a power of 2
+    size_t head;                // bytes written so far
+    size_t tail;                // bytes read so far
+    int written;                // the writer is done
+    int dropped;                // the reader is gone
+    int waiting;                // a side is waiting on cond
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct ring *ring_new (size_t size) {
+    struct ring *r = calloc(1, sizeof(struct ring));
+
+    for (r->size = 4096; r->size < size; r->size *= 2);
+    r->s = malloc(r->size);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    return r;
+}
+
+void ring_free (struct ring *r) {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->s);
+    free(r);
+}
+
+// wake up the other side if it waits; the index moved is stored before the
+// flag is looked at, and the waiter sets the flag before it looks at the
+// index, so that one of them sees the other
+static void ring_wake (struct ring *r) {
+    if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+// wait until ready(r) holds
+static void ring_wait (struct ring *r, int (*ready) (struct ring*)) {
+    pthread_mutex_lock(&r->lock);
+    __atomic_add_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    while (!ready(r)) pthread_cond_wait(&r->cond, &r->lock);
+    __atomic_sub_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int can_write (struct ring *r) {
+    return __atomic_load_n(&r->dropped, __ATOMIC_SEQ_CST)
+        || __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) < r->size;
+}
+
+static int can_read (struct ring *r) {
+    return __atomic_load_n(&r->written, __ATOMIC_SEQ_CST)
+        || __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+}
+
+// This function writes all of s[0..n) to the ring, waiting for room as
+// needed; returns -1 if the reader has gone
+int ring_write (struct ring *r, const char *s, size_t n) {
+    size_t head = r->head, room, m, at;
+
+    while (n) {
+        if (!can_write(r)) ring_wait(r, can_write);
+        if (__atomic_load_n(&r->dropped, __ATOMIC_SEQ_CST)) return -1;
+        room = r->size - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+        m = n < room ? n : room;
+        at = head & (r->size - 1);
+        if (at + m <= r->size) {
+            memcpy(r->s + at, s, m);
+        } else {
+            memcpy(r->s + at, s, r->size - at);
+            memcpy(r->s, s + r->size - at, m - (r->size - at));
+        }
+        head += m;
+        s += m;
+        n -= m;
+        __atomic_store_n(&r->head, head, __ATOMIC_SEQ_CST);
+        ring_wake(r);
+    }
+    return 0;
+}
+
+// This function reads at most n bytes of the ring into s, waiting for some
+// as needed; returns 0 once the writer is done and the ring empty
+size_t ring_read (struct ring *r, char *s, size_t n) {
+    size_t tail = r->tail, len, m, at;
+
+    if (!can_read(r)) ring_wait(r, can_read);
+    len = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+    m = n < len ? n : len;
+    at = tail & (r->size - 1);
+    if (at + m <= r->size) {
+        memcpy(s, r->s + at, m);
+    } else {
+        memcpy(s, r->s + at, r->size - at);
+        memcpy(s + r->size - at, r->s, m - (r->size - at));
+    }
+    __atomic_store_n(&r->tail, tail + m, __ATOMIC_SEQ_CST);
+    ring_wake(r);
+    return m;
+}
+
+// the writer is done: the reader gets the end of its input
+void ring_close_write (struct ring *r) {
+    __atomic_store_n(&r->written, 1, __ATOMIC_SEQ_CST);
+    ring_wake(r);
+}
+
+// the reader is gone: the writer gets an error, as on a broken pipe
+void ring_close_read (struct ring *r) {
+    __atomic_store_n(&r->dropped, 1, __ATOMIC_SEQ_CST);
+    ring_wake(r);
+}
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <regex.h>
+#include <sys/stat.h>
+
+#include "global.h"
+
+// The [[ ... ]] test.  Its words are expanded as they are evaluated, without
+// field splitting; the right operand of == and != is a glob pattern, the one
+// of =~ an extended regular expression whose groups are stored in the array
+// BASH_REMATCH when it matches.
+
+// the compiled regular expressions are kept in a cache keyed by their text,
+// the most recently used first, so that a test run in a loop only compiles
+// its expression once
+#define REGEX_CACHE 64
+
+struct regex {
+    char *text;
+    regex_t re;
+};
+
+static struct regex *cache[REGEX_CACHE];
+static int cached;
+
+// the words of the test, and the one being evaluated
+struct test {
+    char **w;
+    int i;
+    int error;
+};
+
+static int test_or (struct test *t, int run);
+
+// return the compiled regular expression for text, compiling it on the first use
+static regex_t *regex_get (const char *text) {
+    struct regex *r;
+    char msg[256];
+    int i, err;
+
+    for (i = 0; i < cached; i++) {
+        if (strcmp(cache[i]->text, text) == 0) {
+            r = cache[i];
+            memmove(cache + 1, cache, i * sizeof(struct regex*));
+            return &(cache[0] = r)->re;
+        }
+    }
+    r = malloc(sizeof(struct regex));
+    if ((err = regcomp(&r->re, text, REG_EXTENDED))) {
+        regerror(err, &r->re, msg, sizeof(msg));
+        fprintf(stderr, "error: %s: %s\n", msg, text);
+        free(r);
+        return NULL;
+    }
+    r->text = strdup(text);
+    if (cached == REGEX_CACHE) {
+        struct regex *old = cache[--cached];
+
+        regfree(&old->re);
+        free(old->text);
+        free(old);
+    }
+    memmove(cache + 1, cache, cached++ * sizeof(struct regex*));
+    return &(cache[0] = r)->re;
+}
+
+// match s against the regular expression, setting BASH_REMATCH
+static int regex_match (char *s, char *text) {
+    regex_t *re = regex_get(text);
+    regmatch_t *m;
+    char **groups;
+    size_t i, n;
+
+    if (!re) return -1;
+    n = re->re_nsub + 1;
+    m = malloc(n * sizeof(regmatch_t));
+    if (regexec(re, s, n, m, 0) != 0) {
+        var_unset("BASH_REMATCH");
+        free(m);
+        return 0;
+    }
+    groups = malloc(n * sizeof(char*));
+    for (i = 0; i < n; i++) {
+        // a group that took no part in the match is empty
+        if (m[i].rm_so == -1) groups[i] = strdup("");
+        else groups[i] = strndup(s + m[i].rm_so, m[i].rm_eo - m[i].rm_so);
+    }
+    var_seta("BASH_REMATCH", groups, n);
+    for (i = 0; i < n; i++) free(groups[i]);
+    free(groups);
+    free(m);
+    return 1;
+}
+
+static int is (struct test *t, int i, const char *word) {
+    return t->w[t->i + i] && strcmp(t->w[t->i + i], word) == 0;
+}
+
+static void test_error (struct test *t) {
+    if (!t->error) {
+        fprintf(stderr, "error: [[: unexpected %s\n", t->w[t->i] ? t->w[t->i] : "end of test");
+    }
+    t->error = 1;
+}
+
+static const char *binops[] = {
+    "==", "=", "!=", "=~", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL
+};
+
+static int binop (char *word) {
+    int i;
+
+    for (i = 0; binops[i]; i++) {
+        if (strcmp(word, binops[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// the integer value of an operand of -eq and the like
+static int test_number (struct test *t, char *s, long long *value) {
+    if (arith(s, strlen(s), value) == -1) {
+        t->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// evaluate left op right, op being binops[op]
+static int test_binary (struct test *t, char *left, int op, char *right) {
+    long long a, b;
+    struct pattern *pat;
+    char *text;
+    int r;
+
+    switch (op) {
+        case 0: case 1: case 2:
+            if (!(pat = expand_pattern(right))) {
+                t->error = 1;
+                return 0;
+            }
+            return pat_match(pat, left, strlen(left)) == (op != 2);
+        case 3:
+            if (!(text = expand_regex(right))) {
+                t->error = 1;
+                return 0;
+            }
+            if ((r = regex_match(left, text)) == -1) t->error = 1;
+            free(text);
+            return r == 1;
+        case 4: return strcmp(left, right) < 0;
+        case 5: return strcmp(left, right) > 0;
+    }
+    if (test_number(t, left, &a) == -1 || test_number(t, right, &b) == -1) return 0;
+    switch (op) {
+        case 6:  return a == b;
+        case 7:  return a != b;
+        case 8:  return a < b;
+        case 9:  return a <= b;
+        case 10: return a > b;
+        default: return a >= b;
+    }
+}
+
+// evaluate the unary operator op on the operand s
+static int test_unary (char op, char *s) {
+    struct stat st;
+
+    switch (op) {
+        case 'n': return *s != 0;
+        case 'z': return *s == 0;
+        case 'h':
+        case 'L': return lstat(s, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(s, R_OK) == 0;
+        case 'w': return access(s, W_OK) == 0;
+        case 'x': return access(s, X_OK) == 0;
+    }
+    if (stat(s, &st) == -1) return 0;
+    switch (op) {
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 's': return st.st_size > 0;
+        default:  return 1;
+    }
+}
+
+// a primary: ( expression ), a unary or binary test, or a single word
+// tested for being non-empty; nothing is expanded unless run is set
+static int test_primary (struct test *t, int run) {
+    char *left, *right, *w = t->w[t->i];
+    int op, r = 0;
+
+    if (!w) {
+        test_error(t);
+        return 0;
+    }
+    if (is(t, 0, "(")) {
+        t->i++;
+        r = test_or(t, run);
+        if (!is(t, 0, ")")) {
+            test_error(t);
+            return 0;
+        }
+        t->i++;
+        return r;
+    }
+    if (t->w[t->i + 1] && (op = binop(t->w[t->i + 1])) >= 0) {
+        if (!t->w[t->i + 2]) {
+            t->i += 2;
+            test_error(t);
+            return 0;
+        }
+        if (run) {
+            left = expand_word(w);
+            // the operand of a pattern or regular expression is kept raw
+            right = op <= 3 ? t->w[t->i + 2] : expand_word(t->w[t->i + 2]);
+            if (left && right) r = test_binary(t, left, op, right);
+            else t->error = 1;
+            free(left);
+            if (op > 3) free(right);
+        }
+        t->i += 3;
+        return r;
+    }
+    if (w[0] == '-' && w[1] && strchr("nzefdsrwxhL", w[1]) && !w[2] && t->w[t->i + 1]) {
+        if (run) {
+            if ((right = expand_word(t->w[t->i + 1]))) r = test_unary(w[1], right);
+            else t->error = 1;
+            free(right);
+        }
+        t->i += 2;
+        return r;
+    }
+    if (run) {
+        if ((left = expand_word(w))) r = *left != 0;
+        else t->error = 1;
+        free(left);
+    }
+    t->i++;
+    return r;
+}
+
+static int test_not (struct test *t, int run) {
+    if (is(t, 0, "!")) {
+        t->i++;
+        return !test_not(t, run);
+    }
+    return test_primary(t, run);
+}
+
+// && binds tighter than ||; their right side is only expanded if needed
+static int test_and (struct test *t, int run) {
+    int r = test_not(t, run);
+
+    while (is(t, 0, "&&")) {
+        t->i++;
+        r = test_not(t, run && r) && r;
+    }
+    return r;
+}
+
+static int test_or (struct test *t, int run) {
+    int r = test_and(t, run);
+
+    while (is(t, 0, "||")) {
+        t->i++;
+        r = test_and(t, run && !r) || r;
+    }
+    return r;
+}
+
+// run the test of the words; returns 0 if it is true, 1 if it is false and
+// 2 on error
+int test_eval (char **words) {
+    struct test t;
+    int r;
+
+    memset(&t, 0, sizeof(struct test));
+    t.w = words;
+    r = test_or(&t, 1);
+    if (t.w[t.i]) test_error(&t);
+    if (t.error) return 2;
+    return !r;
+}
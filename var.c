@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "global.h"
+
+// The shell variables are kept in a hash table with separate chaining.
+// Only the variables flagged V_EXPORT are passed to the commands launched,
+// through a snapshot of the environment that is only rebuilt after an
+// exported variable changed.
+
+struct var {
+    char *name;
+    char *value;    // NULL for a variable exported before being set
+    int flags;
+    int envidx;     // index of the variable in the snapshot, or -1
+    char **elems;   // the elements of an array, elems[0] being value
+    size_t nelems;
+    struct var *next;
+};
+
+static struct var **table;
+static size_t tablesize;    // number of buckets, always a power of two
+static size_t count;        // number of variables in the table
+
+static char **envp;         // the snapshot, pointers and strings in one block
+static size_t envcount;     // number of entries of the snapshot
+static size_t envsize;      // size of the block
+static int envdirty = 1;    // whether the snapshot must be rebuilt
+
+// exit value of the last command, read as $?
+int laststatus;
+
+// FNV-1a hash of a name
+static unsigned long hash (const char *name, size_t len) {
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+// return the slot holding the variable name, or the empty slot ending its chain
+static struct var **lookup (const char *name, size_t len) {
+    struct var **slot = &table[hash(name, len) & (tablesize - 1)];
+
+    while (*slot && (strncmp((*slot)->name, name, len) || (*slot)->name[len])) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// double the number of buckets
+static void grow (void) {
+    struct var **old = table;
+    size_t oldsize = tablesize, i;
+
+    tablesize = oldsize ? 2 * oldsize : 64;
+    table = calloc(tablesize, sizeof(struct var*));
+    for (i = 0; i < oldsize; i++) {
+        struct var *v = old[i], *next;
+
+        for (; v; v = next) {
+            struct var **slot = &table[hash(v->name, strlen(v->name)) & (tablesize - 1)];
+
+            next = v->next;
+            v->next = *slot;
+            *slot = v;
+        }
+    }
+    free(old);
+}
+
+// initialize the table with the environment, whose variables are all exported
+void var_init (char **env) {
+    int i;
+
+    grow();
+    for (i = 0; env[i]; i++) {
+        char *eq = strchr(env[i], '=');
+
+        if (eq && eq > env[i]) {
+            var_setn(env[i], eq - env[i], eq + 1, V_EXPORT);
+        }
+    }
+}
+
+// length of the variable name at the start of s, 0 if there is none
+size_t var_namelen (const char *s) {
+    size_t len = 0;
+
+    if (!isalpha((unsigned char) *s) && *s != '_') return 0;
+    while (isalnum((unsigned char) s[len]) || s[len] == '_') len++;
+    return len;
+}
+
+// value of the variable name[0..len), or NULL if it is not set
+char *var_getn (const char *name, size_t len) {
+    static char status[3 * sizeof(int) + 2];
+    struct var *v;
+
+    if (len == 1 && *name == '?') {
+        sprintf(status, "%d", laststatus);
+        return status;
+    }
+    v = *lookup(name, len);
+    return v ? v->value : NULL;
+}
+
+char *var_get (const char *name) {
+    return var_getn(name, strlen(name));
+}
+
+// set the variable name[0..len) to value (keeping its current value if value
+// is NULL) and add flags to its flags
+int var_setn (const char *name, size_t len, const char *value, int flags) {
+    struct var **slot, *v;
+
+    if (!len || var_namelen(name) < len) return -1;
+
+    slot = lookup(name, len);
+    if (!(v = *slot)) {
+        if (count >= tablesize) {
+            grow();
+            slot = lookup(name, len);
+        }
+        v = *slot = calloc(1, sizeof(struct var));
+        v->name = strndup(name, len);
+        v->envidx = -1;
+        count++;
+    }
+    if (value) {
+        free(v->value);
+        v->value = strdup(value);
+        if (v->elems) v->elems[0] = v->value;
+    }
+    if ((v->flags | flags) & V_EXPORT && (value || !(v->flags & V_EXPORT))) {
+        envdirty = 1;
+    }
+    v->flags |= flags;
+    return 0;
+}
+
+int var_set (const char *name, const char *value, int flags) {
+    return var_setn(name, strlen(name), value, flags);
+}
+
+// free the elements of an array but the first one, its value
+static void free_elems (struct var *v) {
+    size_t i;
+
+    if (!v->elems) return;
+    for (i = 1; i < v->nelems; i++) free(v->elems[i]);
+    free(v->elems);
+    v->elems = NULL;
+    v->nelems = 0;
+}
+
+int var_unset (const char *name) {
+    struct var **slot = lookup(name, strlen(name)), *v = *slot;
+
+    if (!v) return -1;
+    if (v->flags & V_EXPORT) envdirty = 1;
+    *slot = v->next;
+    free_elems(v);
+    free(v->name);
+    free(v->value);
+    free(v);
+    count--;
+    return 0;
+}
+
+// make name an array of the n values; an empty array is unset
+int var_seta (const char *name, char **values, size_t n) {
+    struct var *v;
+    size_t i;
+
+    if (!n) {
+        var_unset(name);
+        return 0;
+    }
+    if (var_set(name, values[0], 0)) return -1;
+    v = *lookup(name, strlen(name));
+    free_elems(v);
+    v->elems = malloc(n * sizeof(char*));
+    v->elems[0] = v->value;
+    for (i = 1; i < n; i++) v->elems[i] = strdup(values[i]);
+    v->nelems = n;
+    return 0;
+}
+
+// the elements of the variable name[0..len), a single one if it is not an
+// array; *n is set to their number
+char **var_getall (const char *name, size_t len, size_t *n) {
+    struct var *v = *lookup(name, len);
+
+    if (!v || !v->value) {
+        *n = 0;
+        return NULL;
+    }
+    if (!v->elems) {
+        *n = 1;
+        return &v->value;
+    }
+    *n = v->nelems;
+    return v->elems;
+}
+
+// element i of the variable name[0..len), counting from the end if i is
+// negative, or NULL
+char *var_geti (const char *name, size_t len, long i) {
+    size_t n;
+    char **elems = var_getall(name, len, &n);
+
+    if (i < 0) i += n;
+    return i >= 0 && (size_t) i < n ? elems[i] : NULL;
+}
+
+// return the NULL-terminated "NAME=value" array of the exported variables;
+// it is shared and stays valid until an exported variable changes
+char **var_environ (void) {
+    size_t i, n = 0, size = 0;
+    struct var *v;
+    char *str;
+
+    if (!envdirty) return envp;
+
+    for (i = 0; i < tablesize; i++) {
+        for (v = table[i]; v; v = v->next) {
+            if (!(v->flags & V_EXPORT) || !v->value) continue;
+            size += strlen(v->name) + strlen(v->value) + 2;
+            n++;
+        }
+    }
+
+    free(envp);
+    envsize = (n + 1) * sizeof(char*) + size;
+    envp = malloc(envsize);
+    str = (char*) (envp + n + 1);
+    for (i = n = 0; i < tablesize; i++) {
+        for (v = table[i]; v; v = v->next) {
+            if (!(v->flags & V_EXPORT) || !v->value) {
+                v->envidx = -1;
+                continue;
+            }
+            v->envidx = n;
+            envp[n++] = str;
+            str += sprintf(str, "%s=%s", v->name, v->value) + 1;
+        }
+    }
+    envp[n] = NULL;
+    envcount = n;
+    envdirty = 0;
+    return envp;
+}
+
+// the room the snapshot takes, as counted by the limit of execve
+size_t var_envsize (void) {
+    var_environ();
+    return envsize;
+}
+
+// return a copy of the pointers of the snapshot with the "NAME=value"
+// strings of pairs replacing or added to its entries; the strings are
+// taken, and those replaced by a later one of the same name freed
+char **var_overlay (char **pairs) {
+    char **env = var_environ(), **over;
+    size_t i, n = envcount;
+
+    for (i = 0; pairs[i]; i++);
+    over = malloc((envcount + i + 1) * sizeof(char*));
+    memcpy(over, env, envcount * sizeof(char*));
+    for (i = 0; pairs[i]; i++) {
+        size_t len = strcspn(pairs[i], "="), j;
+        struct var *v = *lookup(pairs[i], len);
+
+        if (v && v->envidx >= 0) {
+            if (over[v->envidx] != env[v->envidx]) free(over[v->envidx]);
+            over[v->envidx] = pairs[i];
+            continue;
+        }
+        // a name given twice: the last assignment wins, as in sh
+        for (j = envcount; j < n; j++) {
+            if (!strncmp(over[j], pairs[i], len + 1)) break;
+        }
+        if (j < n) free(over[j]);
+        over[j] = pairs[i];
+        if (j == n) n++;
+    }
+    over[n] = NULL;
+    return over;
+}
+
+// free an array returned by var_overlay, with the strings it added to the
+// snapshot, which must not have changed since
+void var_overlay_free (char **over) {
+    char *start = (char*) envp, *end = start + envsize;
+    size_t i;
+
+    for (i = 0; over[i]; i++) {
+        if (over[i] < start || over[i] >= end) free(over[i]);
+    }
+    free(over);
+}
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "global.h"
+
+// The directory tree walker behind the ** glob.  The directories to read are
+// spread over a pool of threads: each has a queue of its own, which it uses
+// last in first out so that it goes deep and keeps few directories open,
+// and from which the idle threads steal the oldest entries, the closest to
+// the root and so the largest pieces of work.  A directory is opened with
+// openat relative to the descriptor of its parent, kept open while some of
+// its subdirectories are waiting.  Each thread sorts the paths it found,
+// and the lists are merged at the end.
+
+#define WALK_THREADS 16
+#define DENTS_SIZE 65536
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// an open directory, closed when its last waiting subdirectory is opened
+struct dirref {
+    int fd;
+    atomic_int refs;
+};
+
+struct task {
+    struct dirref *parent;      // NULL for the root
+    char *path;                 // path from the root of the walk
+    char *name;                 // name in the parent, the end of path
+};
+
+struct queue {
+    pthread_mutex_t lock;
+    struct task *v;
+    size_t head, tail, cap;     // the owner works at the tail, thieves at the head
+};
+
+struct walker {
+    struct walk *walk;
+    struct queue q;
+    char **out;                 // the paths found, sorted once done
+    size_t n, cap;
+    char *dents;
+};
+
+struct walk {
+    struct pattern *pat;        // the names kept, or all if NULL
+    int flags;
+    int nworkers;
+    struct walker *workers;
+    atomic_long pending;        // tasks queued or being run
+    atomic_long queued;         // tasks queued
+    atomic_int idle;            // workers waiting for a task
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void push (struct walker *w, struct task *t) {
+    struct walk *wk = w->walk;
+    struct queue *q = &w->q;
+
+    atomic_fetch_add(&wk->pending, 1);
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        // move the entries to the front, or make room
+        if (q->head) {
+            memmove(q->v, q->v + q->head, (q->tail - q->head) * sizeof(struct task));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            q->cap = q->cap ? 2 * q->cap : 64;
+            q->v = realloc(q->v, q->cap * sizeof(struct task));
+        }
+    }
+    q->v[q->tail++] = *t;
+    pthread_mutex_unlock(&q->lock);
+
+    atomic_fetch_add(&wk->queued, 1);
+    if (atomic_load(&wk->idle)) {
+        pthread_mutex_lock(&wk->lock);
+        pthread_cond_signal(&wk->cond);
+        pthread_mutex_unlock(&wk->lock);
+    }
+}
+
+// take a task from the tail of the queue (own) or from its head (stolen)
+static int take (struct walk *wk, struct queue *q, struct task *t, int own) {
+    int found = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *t = own ? q->v[--q->tail] : q->v[q->head++];
+        if (q->head == q->tail) q->head = q->tail = 0;
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (found) atomic_fetch_sub(&wk->queued, 1);
+    return found;
+}
+
+static void release (struct dirref *d) {
+    if (d && atomic_fetch_sub(&d->refs, 1) == 1) {
+        close(d->fd);
+        free(d);
+    }
+}
+
+static void found (struct walker *w, char *path) {
+    if (w->n == w->cap) {
+        w->cap = w->cap ? 2 * w->cap : 256;
+        w->out = realloc(w->out, w->cap * sizeof(char*));
+    }
+    w->out[w->n++] = path;
+}
+
+// read the directory of the task, keeping its matching entries and queueing
+// its subdirectories
+static void visit (struct walker *w, struct task *t) {
+    struct walk *wk = w->walk;
+    struct dirref *dir;
+    size_t len = strlen(t->path);
+    int slash = len && t->path[len - 1] != '/';
+    long nread, off;
+    int fd;
+
+    fd = openat(t->parent ? t->parent->fd : AT_FDCWD, t->name,
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    release(t->parent);
+    if (fd == -1) {
+        free(t->path);
+        return;
+    }
+    dir = malloc(sizeof(struct dirref));
+    dir->fd = fd;
+    atomic_init(&dir->refs, 1);
+
+    while ((nread = syscall(SYS_getdents64, fd, w->dents, DENTS_SIZE)) > 0) {
+        for (off = 0; off < nread; off += ((struct linux_dirent64*) (w->dents + off))->d_reclen) {
+            struct linux_dirent64 *e = (struct linux_dirent64*) (w->dents + off);
+            size_t n = strlen(e->d_name);
+            int type = e->d_type;
+            char *path;
+
+            // the hidden entries are skipped, and only matched by a literal dot
+            if (e->d_name[0] == '.' && (!(wk->flags & WALK_DOT) || n == 1 || (n == 2 && e->d_name[1] == '.'))) {
+                continue;
+            }
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+
+                if (fstatat(fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+
+            path = malloc(len + n + 2);
+            memcpy(path, t->path, len);
+            path[len] = '/';
+            memcpy(path + len + slash, e->d_name, n + 1);
+
+            if ((!(wk->flags & WALK_DIRS) || type == DT_DIR)
+                    && (!wk->pat || pat_match(wk->pat, e->d_name, n))) {
+                found(w, strdup(path));
+            }
+            // symbolic links are not followed, nor hidden directories entered
+            if (type == DT_DIR && e->d_name[0] != '.') {
+                struct task sub = { dir, path, path + len + slash };
+
+                atomic_fetch_add(&dir->refs, 1);
+                push(w, &sub);
+            } else {
+                free(path);
+            }
+        }
+    }
+    release(dir);
+    free(t->path);
+}
+
+static int path_cmp (const void *a, const void *b) {
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+static void *work (void *arg) {
+    struct walker *w = arg;
+    struct walk *wk = w->walk;
+    struct task t;
+    int i;
+
+    for (;;) {
+        int got = take(wk, &w->q, &t, 1);
+
+        // steal from the others, starting with the next one
+        for (i = 1; !got && i < wk->nworkers; i++) {
+            got = take(wk, &wk->workers[(w - wk->workers + i) % wk->nworkers].q, &t, 0);
+        }
+        if (got) {
+            visit(w, &t);
+            if (atomic_fetch_sub(&wk->pending, 1) == 1) {
+                // the walk is over
+                pthread_mutex_lock(&wk->lock);
+                pthread_cond_broadcast(&wk->cond);
+                pthread_mutex_unlock(&wk->lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&wk->lock);
+        atomic_fetch_add(&wk->idle, 1);
+        while (!atomic_load(&wk->queued) && atomic_load(&wk->pending)) {
+            pthread_cond_wait(&wk->cond, &wk->lock);
+        }
+        atomic_fetch_sub(&wk->idle, 1);
+        pthread_mutex_unlock(&wk->lock);
+        if (!atomic_load(&wk->pending)) break;
+    }
+    qsort(w->out, w->n, sizeof(char*), path_cmp);
+    return NULL;
+}
+
+// return the sorted NULL-terminated list of the paths under the directory
+// base (the current one if empty) whose names match pat (all if NULL),
+// keeping only directories with WALK_DIRS and including hidden names with
+// WALK_DOT; *n is set to their number
+char **walk_tree (const char *base, struct pattern *pat, int flags, size_t *n) {
+    struct walk wk;
+    struct task root;
+    pthread_t threads[WALK_THREADS];
+    size_t total = 0, *pos;
+    char **out;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, started;
+
+    memset(&wk, 0, sizeof(struct walk));
+    wk.pat = pat;
+    wk.flags = flags;
+    wk.nworkers = ncpu < 1 ? 1 : ncpu > WALK_THREADS ? WALK_THREADS : ncpu;
+    wk.workers = calloc(wk.nworkers, sizeof(struct walker));
+    pthread_mutex_init(&wk.lock, NULL);
+    pthread_cond_init(&wk.cond, NULL);
+    for (i = 0; i < wk.nworkers; i++) {
+        wk.workers[i].walk = &wk;
+        wk.workers[i].dents = malloc(DENTS_SIZE);
+        pthread_mutex_init(&wk.workers[i].q.lock, NULL);
+    }
+
+    root.parent = NULL;
+    root.path = strdup(base);
+    root.name = *base ? root.path : ".";
+    push(&wk.workers[0], &root);
+
+    // the calling thread is the first worker.  wk.nworkers stays as it is,
+    // the threads reading it: the queues of the workers that could not be
+    // started stay empty, and stealing from them finds nothing.
+    for (started = 1; started < wk.nworkers; started++) {
+        if (pthread_create(&threads[started], NULL, work, &wk.workers[started])) break;
+    }
+    work(&wk.workers[0]);
+    for (i = 1; i < started; i++) pthread_join(threads[i], NULL);
+
+    // merge the sorted lists
+    for (i = 0; i < started; i++) total += wk.workers[i].n;
+    out = malloc((total + 1) * sizeof(char*));
+    pos = calloc(started, sizeof(size_t));
+    for (*n = 0; *n < total; ) {
+        int best = -1;
+
+        for (i = 0; i < started; i++) {
+            struct walker *w = &wk.workers[i];
+
+            if (pos[i] < w->n && (best < 0 || strcmp(w->out[pos[i]], wk.workers[best].out[pos[best]]) < 0)) {
+                best = i;
+            }
+        }
+        out[(*n)++] = wk.workers[best].out[pos[best]++];
+    }
+    out[total] = NULL;
+
+    for (i = 0; i < wk.nworkers; i++) {
+        free(wk.workers[i].out);
+        free(wk.workers[i].dents);
+        free(wk.workers[i].q.v);
+        pthread_mutex_destroy(&wk.workers[i].q.lock);
+    }
+    free(wk.workers);
+    free(pos);
+    pthread_mutex_destroy(&wk.lock);
+    pthread_cond_destroy(&wk.cond);
+    return out;
+}
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "global.h"
+
+// The compressed redirections: ">z file" and ">>z file" give the command a
+// pipe as its output, which a thread of the shell compresses into the file
+// as a gzip stream (a new member after the end of the file for >>z), and
+// "<z file" a pipe as its input, into which a thread writes the file
+// decompressed.  The threads end with the command: executeAux waits for the
+// ones started for it once it has closed its end of their pipes.
+
+#define ZIP_BLOCK (1 << 17)
+
+struct zipstream {
+    pthread_t thread;
+    int pipe;           // the shell's end of the pipe
+    int file;
+    int failed;
+};
+
+// the streams running, the latest last
+static struct zipstream **zips;
+int nzips;
+static int zipscap;
+static pthread_mutex_t zip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the ends held by the threads are no one else's: the children forked
+// meanwhile close them
+static void zip_prepare (void) {
+    pthread_mutex_lock(&zip_lock);
+}
+
+static void zip_parent (void) {
+    pthread_mutex_unlock(&zip_lock);
+}
+
+static void zip_child (void) {
+    while (nzips) {
+        nzips--;
+        if (zips[nzips]->pipe != -1) close(zips[nzips]->pipe);
+        close(zips[nzips]->file);
+    }
+    pthread_mutex_unlock(&zip_lock);
+}
+
+// a reader gone makes the writes fail with EPIPE: SIGPIPE would stop the
+// shell
+static void zip_nosigpipe (void) {
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static int write_all (int fd, const char *s, size_t n) {
+    ssize_t w;
+
+    for (; n; s += w, n -= w) {
+        if ((w = write(fd, s, n)) == -1) {
+            if (errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void zip_error (struct zipstream *z, const char *what) {
+    if (!z->failed) fprintf(stderr, "error: compressed redirection: %s\n", what);
+    z->failed = 1;
+}
+
+// compress the pipe into the file until all of its writers are gone
+static void *zip_deflate (void *arg) {
+    struct zipstream *z = arg;
+    char *in = malloc(ZIP_BLOCK), *out = malloc(ZIP_BLOCK);
+    z_stream s;
+    ssize_t n;
+    int flush;
+
+    zip_nosigpipe();
+    memset(&s, 0, sizeof(z_stream));
+    if (deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        zip_error(z, "out of memory");
+    }
+    do {
+        while ((n = read(z->pipe, in, ZIP_BLOCK)) == -1 && errno == EINTR);
+        if (n == -1) {
+            zip_error(z, strerror(errno));
+            n = 0;
+        }
+        // once failed, the output is still read, so that the command ends
+        if (z->failed) continue;
+        flush = n ? Z_NO_FLUSH : Z_FINISH;
+        s.next_in = (Bytef*) in;
+        s.avail_in = n;
+        do {
+            s.next_out = (Bytef*) out;
+            s.avail_out = ZIP_BLOCK;
+            deflate(&s, flush);
+            if (write_all(z->file, out, ZIP_BLOCK - s.avail_out) == -1) {
+                zip_error(z, strerror(errno));
+                break;
+            }
+        } while (!s.avail_out);
+    } while (n);
+    deflateEnd(&s);
+    free(in);
+    free(out);
+    return NULL;
+}
+
+// decompress the file into the pipe, the members of the gzip stream one
+// after the other, until the end of the file or the reader is gone
+static void *zip_inflate (void *arg) {
+    struct zipstream *z = arg;
+    char *in = malloc(ZIP_BLOCK), *out = malloc(ZIP_BLOCK);
+    z_stream s;
+    ssize_t n;
+    int ret = Z_STREAM_END, any = 0, gone = 0;
+
+    zip_nosigpipe();
+    memset(&s, 0, sizeof(z_stream));
+    if (inflateInit2(&s, 15 + 32) != Z_OK) zip_error(z, "out of memory");
+    while (!z->failed && !gone) {
+        while ((n = read(z->file, in, ZIP_BLOCK)) == -1 && errno == EINTR);
+        if (n == -1) zip_error(z, strerror(errno));
+        if (n <= 0) break;
+        s.next_in = (Bytef*) in;
+        s.avail_in = n;
+        while (s.avail_in && !z->failed && !gone) {
+            // a member ended: another one may follow
+            if (ret == Z_STREAM_END && any) inflateReset(&s);
+            s.next_out = (Bytef*) out;
+            s.avail_out = ZIP_BLOCK;
+            ret = inflate(&s, Z_NO_FLUSH);
+            any = 1;
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                zip_error(z, s.msg ? s.msg : "not compressed data");
+            } else if (write_all(z->pipe, out, ZIP_BLOCK - s.avail_out) == -1) {
+                if (errno == EPIPE) gone = 1;
+                else zip_error(z, strerror(errno));
+            }
+        }
+    }
+    if (!z->failed && !gone && ret != Z_STREAM_END) zip_error(z, "unexpected end of compressed data");
+    inflateEnd(&s);
+    // the reader gets the end of its input
+    pthread_mutex_lock(&zip_lock);
+    close(z->pipe);
+    z->pipe = -1;
+    pthread_mutex_unlock(&zip_lock);
+    free(in);
+    free(out);
+    return NULL;
+}
+
+// This function makes fd, one of the shell's standard streams, the end of a
+// pipe to or from the file, compressed if output is set, else decompressed;
+// the file is closed.  Returns -1 on failure.
+int zip_start (int file, int fd, int output) {
+    static int registered;
+    struct zipstream *z;
+    int fds[2], rc;
+
+    if (!registered++) pthread_atfork(zip_prepare, zip_parent, zip_child);
+    if (pipe2(fds, O_CLOEXEC) == -1 || fcntl(file, F_SETFD, FD_CLOEXEC) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        close(file);
+        return -1;
+    }
+    z = calloc(1, sizeof(struct zipstream));
+    z->file = file;
+    z->pipe = fds[!output];
+    if (dup2(fds[output], fd) == -1) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        close(file);
+        free(z);
+        return -1;
+    }
+    close(fds[output]);
+    if ((rc = pthread_create(&z->thread, NULL, output ? zip_deflate : zip_inflate, z))) {
+        fprintf(stderr, "error: %s\n", strerror(rc));
+        close(z->pipe);
+        close(file);
+        free(z);
+        return -1;
+    }
+    pthread_mutex_lock(&zip_lock);
+    if (nzips == zipscap) {
+        zipscap = zipscap ? 2 * zipscap : 4;
+        zips = realloc(zips, zipscap * sizeof(struct zipstream*));
+    }
+    zips[nzips++] = z;
+    pthread_mutex_unlock(&zip_lock);
+    return 0;
+}
+
+// This function waits for the streams started after the first mark ones,
+// whose pipes are closed on the command's side; returns -1 if one failed
+int zip_done (int mark) {
+    int retval = 0;
+
+    while (nzips > mark) {
+        struct zipstream *z = zips[nzips - 1];
+
+        pthread_join(z->thread, NULL);
+        pthread_mutex_lock(&zip_lock);
+        nzips--;
+        pthread_mutex_unlock(&zip_lock);
+        if (z->pipe != -1) close(z->pipe);
+        close(z->file);
+        if (z->failed) retval = -1;
+        free(z);
+    }
+    return retval;
+}